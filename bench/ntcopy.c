@@ -0,0 +1,146 @@
+//-----------------------------------------------
+// Bandwidth of the log copy kernels (ntcopy.c) against the size of a record.
+//
+// Each kernel the CPU has first copies every size up to a few lines at every
+// alignment of its destination (and a few of its source), and must write
+// exactly these bytes. Then it appends records of each size one after the other, with a
+// fence after each one as the writers do, until it has written the whole
+// destination a few times.
+//
+//   make bench
+//   NVCACHE_PMEM_BACKEND=2 NVCACHE_PWB_LATENCY=0 obj/bench/ntcopy [file [MiB]]
+//
+// The destination is anonymous memory, or a file (on a DAX file system, a
+// device dax...) mapped shared. It is much larger than the caches.
+//-----------------------------------------------
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include "ntcopy.h"
+
+#define HEADER 64       // A record header between two payloads
+#define CHECK_MAX 320   // Largest size checked, at each alignment
+#define PASSES 4        // Times the destination is written
+
+static const size_t sizes[] = {64,   128,  256,   512,   1024,
+                               4096, 8192, 16384, 65536};
+#define NB_SIZES (sizeof(sizes) / sizeof(sizes[0]))
+
+//-----------------------------------------------
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//-----------------------------------------------
+static void fence(void) { __asm__ volatile("sfence" : : : "memory"); }
+
+//-----------------------------------------------
+// Exact copies: nothing before or after [dst, dst + n) is written
+//-----------------------------------------------
+static int check(int kernel) {
+    static char src[CHECK_MAX + 64], dst[CHECK_MAX + 256];
+    for (size_t i = 0; i < sizeof(src); i++) {
+        src[i] = (char)(i * 7 + 1);
+    }
+    for (size_t n = 0; n <= CHECK_MAX; n++) {
+        for (int s = 0; s < 16; s++) {
+            for (int d = 0; d < 64; d++) {
+                char *to = (char *)(((unsigned long)dst + 63) & ~63UL) + d;
+                memset(dst, 0, sizeof(dst));
+                ntcopy_with(kernel, to, src + s, n);
+                fence();
+                if (memcmp(to, src + s, n)) {
+                    printf("%s: size %zu, src +%d, dst +%d: wrong copy\n",
+                           ntcopy_name(kernel), n, s, d);
+                    return 0;
+                }
+                for (char *c = dst; c < dst + sizeof(dst); c++) {
+                    if ((c < to || c >= to + n) && *c) {
+                        printf("%s: size %zu, src +%d, dst +%d: wrote %+ld\n",
+                               ntcopy_name(kernel), n, s, d,
+                               (long)(c < to ? c - to : c - to - n));
+                        return 0;
+                    }
+                }
+            }
+        }
+    }
+    return 1;
+}
+
+//-----------------------------------------------
+static double bandwidth(int kernel, char *dst, size_t dst_size,
+                        const char *src, size_t n) {
+    size_t step = HEADER + ((n + 63) & ~63UL);
+    size_t records = dst_size / step;
+    double start = now_s();
+    for (int pass = 0; pass < PASSES; pass++) {
+        char *to = dst + HEADER;
+        for (size_t r = 0; r < records; r++, to += step) {
+            ntcopy_with(kernel, to, src, n);
+            fence();
+        }
+    }
+    return (double)records * n * PASSES / (now_s() - start) / 1e9;
+}
+
+//-----------------------------------------------
+int main(int argc, char **argv) {
+    size_t dst_size = (argc > 2 ? atol(argv[2]) : 512) << 20;
+    char *dst;
+    if (argc > 1) {
+        int fd = open(argv[1], O_RDWR | O_CREAT, 0644);
+        if (fd < 0) {
+            perror(argv[1]);
+            return 1;
+        }
+        ftruncate(fd, dst_size);  // Fails on a device dax, already sized
+        dst = mmap(NULL, dst_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    } else {
+        dst = mmap(NULL, dst_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if (dst == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    memset(dst, 0, dst_size);  // No page faults in the measures
+
+    static char src[65536 + 64];
+    memset(src, 0x5a, sizeof(src));
+
+    ntcopy_init(NTCOPY_AUTO);
+    printf("destination %s, %zu MiB, default kernel %s\n",
+           argc > 1 ? argv[1] : "DRAM", dst_size >> 20,
+           ntcopy_name(ntcopy_selected()));
+    printf("%8s", "GB/s");
+    for (size_t i = 0; i < NB_SIZES; i++) {
+        printf(" %7zu", sizes[i]);
+    }
+    printf("\n");
+
+    int failed = 0;
+    for (int k = 0; k < NTCOPY_KERNELS; k++) {
+        if (!ntcopy_supported(k)) {
+            continue;
+        }
+        if (!check(k)) {
+            failed = 1;
+            continue;
+        }
+        printf("%8s", ntcopy_name(k));
+        for (size_t i = 0; i < NB_SIZES; i++) {
+            printf(" %7.2f", bandwidth(k, dst, dst_size, src, sizes[i]));
+            fflush(stdout);
+        }
+        printf("\n");
+    }
+    return failed;
+}
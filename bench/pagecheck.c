@@ -0,0 +1,153 @@
+//-----------------------------------------------
+// Reads and writes of several threads on the same cached pages, checked
+// against a copy of the files in memory.
+//
+// Each thread owns one stripe of STRIPE bytes out of NB_THREADS in every
+// file, and only writes there: the pages are shared, the bytes are not.
+// A thread reads random ranges across the stripes of the others and checks
+// its own bytes in them. The files are written whole first, a read stops
+// at a page the cache holds no bytes of. They do not fit in the RAM cache:
+// pages are evicted and filled again from the disk, which must have the
+// latest bytes once their dirty level is back to 0.
+//
+//   make bench
+//   NVCACHE_PMEM_BACKEND=2 NVCACHE_WRITE_BACK=1 NVCACHE_LOG_SIZE=16777216 \
+//   NVCACHE_RAM_CACHE_SIZE=100 obj/bench/pagecheck [dir [operations]]
+//
+// operations is per thread. NVCACHE_WRITE_BACK=0 checks the record by record
+// write-back. Exits with 1 if a read missed a write.
+//-----------------------------------------------
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NB_FILES 4
+#define NB_THREADS 16
+#define FILE_SIZE (1 << 18)
+#define STRIPE 512
+#define READ_MAX 8192
+
+static int fds[NB_FILES];
+static char *copies[NB_FILES];  // Each byte written by its owner only
+static long operations;
+static int mismatches;
+
+//-----------------------------------------------
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//-----------------------------------------------
+static unsigned long next_random(unsigned long *s) {
+    *s = *s * 6364136223846793005UL + 1442695040888963407UL;
+    return *s >> 33;
+}
+
+//-----------------------------------------------
+static int owner(long offset) { return offset / STRIPE % NB_THREADS; }
+
+//-----------------------------------------------
+// A write inside one of its stripes, or a read of any range
+//-----------------------------------------------
+static void *worker(void *arg) {
+    long t = (long)arg;
+    unsigned long s = t + 1;
+    char buf[READ_MAX];
+    for (long i = 0; i < operations; i++) {
+        int f = next_random(&s) % NB_FILES;
+        if (next_random(&s) % 2) {
+            long stripe = next_random(&s) % (FILE_SIZE / STRIPE / NB_THREADS);
+            long start = (stripe * NB_THREADS + t) * STRIPE;
+            long offset = start + next_random(&s) % STRIPE;
+            size_t len = 1 + next_random(&s) % (start + STRIPE - offset);
+            for (size_t k = 0; k < len; k++) {
+                buf[k] = (char)next_random(&s) | 1;
+            }
+            if (pwrite(fds[f], buf, len, offset) != (ssize_t)len) {
+                perror("pwrite");
+                exit(EXIT_FAILURE);
+            }
+            memcpy(copies[f] + offset, buf, len);
+        } else {
+            size_t len = 1 + next_random(&s) % READ_MAX;
+            long offset = next_random(&s) % (FILE_SIZE - len);
+            ssize_t got = pread(fds[f], buf, len, offset);
+            if (got < 0) {
+                perror("pread");
+                exit(EXIT_FAILURE);
+            }
+            for (long k = 0; k < (long)len; k++) {
+                if (owner(offset + k) != t) {
+                    continue;
+                }
+                char expected = copies[f][offset + k];
+                if ((k < got ? buf[k] : 0) != expected) {
+                    long end = k;
+                    while (end < (long)len && owner(offset + end) == t &&
+                           (end < got ? buf[end] : 0) !=
+                               copies[f][offset + end]) {
+                        end++;
+                    }
+                    printf("MISMATCH read f=%d off=%ld len=%zu "
+                           "diff=[%ld,%ld)\n",
+                           f, offset, len, offset + k, offset + end);
+                    __atomic_add_fetch(&mismatches, 1, __ATOMIC_RELAXED);
+                    break;
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+//-----------------------------------------------
+int main(int argc, char **argv) {
+    char path[4096];
+    const char *dir = argc > 1 ? argv[1] : "/tmp";
+    operations = argc > 2 ? atol(argv[2]) : 50000;
+    for (int f = 0; f < NB_FILES; f++) {
+        snprintf(path, sizeof(path), "%s/pagecheck.%d", dir, f);
+        fds[f] = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fds[f] < 0) {
+            perror(path);
+            return EXIT_FAILURE;
+        }
+        copies[f] = calloc(FILE_SIZE, 1);
+        for (long offset = 0; offset < FILE_SIZE; offset += READ_MAX) {
+            if (pwrite(fds[f], copies[f], READ_MAX, offset) != READ_MAX) {
+                perror("pwrite");
+                return EXIT_FAILURE;
+            }
+        }
+    }
+
+    const char *mode = getenv("NVCACHE_WRITE_BACK");
+    printf("%d threads, %d files of %d KiB, write-back %s\n", NB_THREADS,
+           NB_FILES, FILE_SIZE >> 10,
+           mode && atoi(mode) ? "by page" : "by record");
+    pthread_t threads[NB_THREADS];
+    double start = now_s();
+    for (long t = 0; t < NB_THREADS; t++) {
+        pthread_create(&threads[t], NULL, worker, (void *)t);
+    }
+    for (int t = 0; t < NB_THREADS; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    double elapsed = now_s() - start;
+    printf("%ld operations in %.2f s, %d mismatches\n",
+           NB_THREADS * operations, elapsed, mismatches);
+
+    for (int f = 0; f < NB_FILES; f++) {
+        close(fds[f]);
+        snprintf(path, sizeof(path), "%s/pagecheck.%d", dir, f);
+        unlink(path);
+    }
+    return mismatches ? EXIT_FAILURE : 0;
+}
@@ -0,0 +1,144 @@
+//-----------------------------------------------
+// Recovery time against the fill level of the log.
+//
+// For each level, a child process fills that share of the log with 4 KiB
+// writes at random offsets of a few files, and exits without flushing (as
+// if it had crashed). The next child recovers the log at startup, and is
+// timed against a start on the clean log. The files are smaller than the
+// log: beyond some level, the log holds more overwritten data than live data.
+//
+//   make bench
+//   NVCACHE_PMEM_BACKEND=2 obj/bench/recovery [dir [log MiB [files MiB]]]
+//
+// The benchmark itself runs on anonymous memory (backend 2), the children
+// on a PMEM file in dir (backend 1). NVCACHE_FLUSH_THREADS sets the number
+// of recovery threads.
+//-----------------------------------------------
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NB_FILES 4
+#define WRITE_SIZE 4096
+#define RECORD_SIZE (WRITE_SIZE + 64)  // With its header
+
+static const int levels[] = {10, 25, 50, 75, 90};
+
+//-----------------------------------------------
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+//-----------------------------------------------
+static long env_long(const char *name) {
+    const char *value = getenv(name);
+    return value ? atol(value) : 0;
+}
+
+//-----------------------------------------------
+static unsigned long next_random(unsigned long *s) {
+    *s = *s * 6364136223846793005UL + 1442695040888963407UL;
+    return *s >> 33;
+}
+
+//-----------------------------------------------
+// Child: level percent of the log, then a crash
+//-----------------------------------------------
+static void fill(const char *dir, long log_size, long file_size, int level) {
+    char path[4096], buf[WRITE_SIZE];
+    int fds[NB_FILES];
+    for (int i = 0; i < NB_FILES; i++) {
+        snprintf(path, sizeof(path), "%s/recovery.%d", dir, i);
+        fds[i] = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fds[i] < 0) {
+            perror(path);
+            _exit(1);
+        }
+    }
+    unsigned long s = level;
+    long records = log_size / 100 * level / RECORD_SIZE;
+    long blocks = file_size / WRITE_SIZE;
+    for (long i = 0; i < records; i++) {
+        memset(buf, (int)i, sizeof(buf));
+        pwrite(fds[i % NB_FILES], buf, WRITE_SIZE,
+               next_random(&s) % blocks * WRITE_SIZE);
+    }
+    _exit(0);
+}
+
+//-----------------------------------------------
+static double run(const char *self, const char *what, int level) {
+    char arg[16];
+    snprintf(arg, sizeof(arg), "%d", level);
+    double start = now_ms();
+    pid_t pid = fork();
+    if (pid == 0) {
+        execl(self, self, what, arg, (char *)NULL);
+        _exit(127);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "%s %d failed\n", what, level);
+        exit(EXIT_FAILURE);
+    }
+    return now_ms() - start;
+}
+
+//-----------------------------------------------
+int main(int argc, char **argv) {
+    // Children, configured by the environment
+    if (argc == 3 && !strcmp(argv[1], "fill")) {
+        fill(getenv("RECOVERY_DIR"), env_long("NVCACHE_LOG_SIZE"),
+             env_long("RECOVERY_FILE_SIZE"), atoi(argv[2]));
+    }
+    if (argc == 3 && !strcmp(argv[1], "start")) {
+        return 0;  // Recovery runs before main()
+    }
+
+    char pmem[4096], self[4096];
+    const char *dir = argc > 1 ? argv[1] : "/tmp";
+    long log_size = (argc > 2 ? atol(argv[2]) : 256) << 20;
+    long file_size = (argc > 3 ? atol(argv[3]) : 16) << 20;
+    ssize_t n = readlink("/proc/self/exe", self, sizeof(self) - 1);
+    if (n < 0) {
+        perror("/proc/self/exe");
+        return EXIT_FAILURE;
+    }
+    self[n] = 0;
+
+    char value[32];
+    snprintf(pmem, sizeof(pmem), "%s/recovery.pmem", dir);
+    setenv("RECOVERY_DIR", dir, 1);
+    snprintf(value, sizeof(value), "%ld", file_size);
+    setenv("RECOVERY_FILE_SIZE", value, 1);
+    snprintf(value, sizeof(value), "%ld", log_size);
+    setenv("NVCACHE_LOG_SIZE", value, 1);
+    setenv("NVCACHE_PMEM_BACKEND", "1", 1);
+    setenv("NVCACHE_PMEM_PATH", pmem, 1);
+    setenv("NVCACHE_ENABLE_RECOVER", "1", 1);
+    setenv("NVCACHE_FLUSH_THREAD", "0", 1);  // Nothing written back before the crash
+
+    printf("log %ld MiB, %d files of %ld MiB\n", log_size >> 20, NB_FILES,
+           file_size >> 20);
+    printf("%6s %10s %10s %12s %12s\n", "fill", "records", "log MiB",
+           "recovery ms", "clean ms");
+    for (size_t i = 0; i < sizeof(levels) / sizeof(levels[0]); i++) {
+        long records = log_size / 100 * levels[i] / RECORD_SIZE;
+        unlink(pmem);
+        run(self, "fill", levels[i]);
+        double recovery = run(self, "start", levels[i]);
+        double clean = run(self, "start", levels[i]);
+        printf("%5d%% %10ld %10ld %12.1f %12.1f\n", levels[i], records,
+               records * RECORD_SIZE >> 20, recovery - clean, clean);
+    }
+    unlink(pmem);
+    return 0;
+}
@@ -0,0 +1,55 @@
+#include "crc32c.h"
+
+//-----------------------------------------------
+// The crc32 instruction of SSE4.2 computes CRC32C, 8 bytes at a time. CPUs
+// without it use a table, a byte at a time: only the recovery and the writers
+// of such machines pay for it. The instruction is written in assembly, the
+// library is not built with -msse4.2.
+//-----------------------------------------------
+#define CRC32C_POLY 0x82F63B78  // Reversed
+
+static uint32_t table[256];
+static int hardware = 0;
+
+//-----------------------------------------------
+void crc32c_init(void) {
+    unsigned int eax, ebx, ecx, edx;
+    __asm__("cpuid"
+            : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx)
+            : "a"(1), "c"(0));
+    hardware = ecx >> 20 & 1;
+
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = crc >> 1 ^ (crc & 1 ? CRC32C_POLY : 0);
+        }
+        table[i] = crc;
+    }
+}
+
+//-----------------------------------------------
+int crc32c_hardware(void) { return hardware; }
+
+//-----------------------------------------------
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    crc = ~crc;
+    if (hardware) {
+        uint64_t crc64 = crc;
+        for (; len >= 8; len -= 8, p += 8) {
+            uint64_t word;
+            __builtin_memcpy(&word, p, 8);  // Built -ffreestanding
+            __asm__("crc32q %1, %0" : "+r"(crc64) : "rm"(word));
+        }
+        crc = crc64;
+        for (; len; len--, p++) {
+            __asm__("crc32b %1, %0" : "+r"(crc) : "rm"(*p));
+        }
+    } else {
+        for (; len; len--, p++) {
+            crc = crc >> 8 ^ table[(crc ^ *p) & 0xff];
+        }
+    }
+    return ~crc;
+}
@@ -0,0 +1,17 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// CRC32C (Castagnoli) of the log records, see crc32c.c. crc is the CRC of the
+// bytes before buf (0 to start), as in zlib's crc32().
+void crc32c_init(void);
+int crc32c_hardware(void);
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,95 @@
+#include "ebr.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+//-----------------------------------------------
+// Epoch-based reclamation for the structures read without locks (the radix
+// trees of the RAM cache). Readers run between ebr_enter() and ebr_exit();
+// an object unlinked from the structure is handed to ebr_retire(), and only
+// released once every reader that may have seen it has left.
+//
+// libc code cannot rely on thread-local storage: a reader claims one of the
+// EBR_SLOTS slots for the duration of its section, starting from a slot
+// derived from its thread so that threads seldom share a cache line.
+//-----------------------------------------------
+#define EBR_SLOTS 256
+
+typedef struct {
+    atomic_uint_least64_t epoch;  // Epoch seen at ebr_enter(), 0 when free
+} __attribute__((aligned(64))) ebr_slot_t;
+
+typedef struct retired_s {
+    struct retired_s *next;
+    void *ptr;
+    void (*release)(void *);
+    uint64_t epoch;  // Epoch when it was unlinked
+} retired_t;
+
+static ebr_slot_t slots[EBR_SLOTS];
+static atomic_uint_least64_t global_epoch = 1;
+static retired_t *retired = NULL;
+static pthread_mutex_t retired_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//-----------------------------------------------
+//             NOT EXPORTED
+//-----------------------------------------------
+static uint64_t oldest_reader(void);
+
+//-----------------------------------------------
+int ebr_enter() {
+    unsigned slot = ((uintptr_t)pthread_self() >> 6) * 2654435761u % EBR_SLOTS;
+    while (1) {
+        uint_least64_t free = 0;
+        uint64_t epoch = atomic_load(&global_epoch);
+        if (atomic_compare_exchange_strong(&slots[slot].epoch, &free, epoch)) {
+            return slot;
+        }
+        slot = (slot + 1) % EBR_SLOTS;
+    }
+}
+
+//-----------------------------------------------
+void ebr_exit(int slot) { atomic_store(&slots[slot].epoch, 0); }
+
+//-----------------------------------------------
+uint64_t oldest_reader() {
+    uint64_t oldest = UINT64_MAX;
+    for (int i = 0; i < EBR_SLOTS; i++) {
+        uint64_t epoch = atomic_load(&slots[i].epoch);
+        if (epoch && epoch < oldest) {
+            oldest = epoch;
+        }
+    }
+    return oldest;
+}
+
+//-----------------------------------------------
+// ptr must already be unreachable for new readers. The readers that entered
+// before the epoch moves on may still use it: it is released by a later
+// call, once they are all gone.
+//-----------------------------------------------
+void ebr_retire(void *ptr, void (*release)(void *)) {
+    retired_t *r = malloc(sizeof(retired_t));
+    r->ptr = ptr;
+    r->release = release;
+
+    pthread_mutex_lock(&retired_lock);
+    r->epoch = atomic_fetch_add(&global_epoch, 1);
+    r->next = retired;
+    retired = r;
+
+    uint64_t oldest = oldest_reader();
+    for (retired_t **p = &retired; *p;) {
+        if ((*p)->epoch < oldest) {
+            retired_t *done = *p;
+            *p = done->next;
+            done->release(done->ptr);
+            free(done);
+        } else {
+            p = &(*p)->next;
+        }
+    }
+    pthread_mutex_unlock(&retired_lock);
+}
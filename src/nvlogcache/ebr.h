@@ -0,0 +1,14 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Epoch-based reclamation, see ebr.c
+int ebr_enter(void);
+void ebr_exit(int slot);
+void ebr_retire(void *ptr, void (*release)(void *));
+
+#ifdef __cplusplus
+}
+#endif
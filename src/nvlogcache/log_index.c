@@ -0,0 +1,134 @@
+#include "log_index.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "nvcache_config.h"
+
+//-----------------------------------------------
+// Maps each RAM page of a file to the log records that cover it, so that a
+// dirty miss only visits the records of its page instead of the whole log.
+// A record is referenced once per page it covers, by its segment and
+// position (see nvlog.c).
+//
+// The table has a fixed number of buckets, each with its own lock and its
+// own free list of references: writers of different pages seldom contend,
+// and references are recycled without going through malloc.
+//
+// Each bucket also remembers the last record added on one of its pages, so
+// that the flusher can find a newer record covering the one it is about to
+// write (see obsolete() in nvlog.c). Two pages of a bucket only compete for
+// it: a page that loses it only loses the absorption of its records.
+//-----------------------------------------------
+#define LOG_INDEX_BUCKETS (1 << 16)
+
+typedef struct log_ref {
+    struct log_ref *next;
+    int fd;
+    int segment;
+    size_t page;
+    size_t pos;
+} log_ref_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    log_ref_t *refs;
+    log_ref_t *free;
+    log_ref_t latest;  // Its next is not used
+} __attribute__((aligned(64))) bucket_t;
+
+static bucket_t *buckets;
+
+//-----------------------------------------------
+//             NOT EXPORTED
+//-----------------------------------------------
+static bucket_t *bucket_of(int fd, size_t page);
+
+//-----------------------------------------------
+void log_index_init() {
+    // Zeroed memory holds unlocked mutexes (PTHREAD_MUTEX_INITIALIZER):
+    // the buckets are only touched when used
+    buckets = calloc(LOG_INDEX_BUCKETS, sizeof(bucket_t));
+}
+
+//-----------------------------------------------
+bucket_t *bucket_of(int fd, size_t page) {
+    uint64_t h = (page / RAM_PAGE_SIZE) * 0x9E3779B97F4A7C15ULL ^ fd;
+    return &buckets[(h ^ (h >> 29)) % LOG_INDEX_BUCKETS];
+}
+
+//-----------------------------------------------
+void log_index_add(int fd, size_t offset, size_t size, int segment,
+                   size_t pos) {
+    size_t first = offset - offset % RAM_PAGE_SIZE;
+    for (size_t page = first; page < offset + size; page += RAM_PAGE_SIZE) {
+        bucket_t *b = bucket_of(fd, page);
+        pthread_mutex_lock(&b->lock);
+        log_ref_t *ref = b->free;
+        if (ref) {
+            b->free = ref->next;
+        } else {
+            ref = malloc(sizeof(log_ref_t));
+        }
+        ref->fd = fd;
+        ref->segment = segment;
+        ref->page = page;
+        ref->pos = pos;
+        ref->next = b->refs;
+        b->refs = ref;
+        b->latest = *ref;
+        pthread_mutex_unlock(&b->lock);
+    }
+}
+
+//-----------------------------------------------
+void log_index_remove(int fd, size_t offset, size_t size, int segment,
+                      size_t pos) {
+    size_t first = offset - offset % RAM_PAGE_SIZE;
+    for (size_t page = first; page < offset + size; page += RAM_PAGE_SIZE) {
+        bucket_t *b = bucket_of(fd, page);
+        pthread_mutex_lock(&b->lock);
+        for (log_ref_t **ref = &b->refs; *ref; ref = &(*ref)->next) {
+            if ((*ref)->pos == pos && (*ref)->segment == segment &&
+                (*ref)->page == page) {
+                log_ref_t *gone = *ref;
+                *ref = gone->next;
+                gone->next = b->free;
+                b->free = gone;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&b->lock);
+    }
+}
+
+//-----------------------------------------------
+// Calls fn(segment, pos, arg) on each record covering the page, in no
+// particular order. fn must not use the index.
+//-----------------------------------------------
+void log_index_foreach(int fd, size_t page, void (*fn)(int, size_t, void *),
+                       void *arg) {
+    bucket_t *b = bucket_of(fd, page);
+    pthread_mutex_lock(&b->lock);
+    for (log_ref_t *ref = b->refs; ref; ref = ref->next) {
+        if (ref->fd == fd && ref->page == page) {
+            fn(ref->segment, ref->pos, arg);
+        }
+    }
+    pthread_mutex_unlock(&b->lock);
+}
+
+//-----------------------------------------------
+// The last record added on the page, if the bucket still holds it. It may
+// have been freed since, the caller checks it against the log.
+//-----------------------------------------------
+int log_index_latest(int fd, size_t page, int *segment, size_t *pos) {
+    bucket_t *b = bucket_of(fd, page);
+    pthread_mutex_lock(&b->lock);
+    int found = b->latest.fd == fd && b->latest.page == page;
+    if (found) {
+        *segment = b->latest.segment;
+        *pos = b->latest.pos;
+    }
+    pthread_mutex_unlock(&b->lock);
+    return found;
+}
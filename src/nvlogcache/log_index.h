@@ -0,0 +1,19 @@
+#pragma once
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// DRAM index of the live log records, by (fd, RAM page), see log_index.c
+void log_index_init(void);
+void log_index_add(int fd, size_t offset, size_t size, int segment, size_t pos);
+void log_index_remove(int fd, size_t offset, size_t size, int segment,
+                      size_t pos);
+void log_index_foreach(int fd, size_t page, void (*fn)(int, size_t, void *),
+                       void *arg);
+int log_index_latest(int fd, size_t page, int *segment, size_t *pos);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,186 @@
+#include "ntcopy.h"
+#include "nvcache_config.h"
+#include <stdint.h>
+#include <string.h>
+
+//-----------------------------------------------
+// Streaming copies of the log payloads. The body of a copy is written a
+// whole cache line at a time with non-temporal stores, which go to the
+// media without reading the line first and need no PWB. The head up to the
+// first line boundary and the tail after the last one are copied with
+// regular stores and written back with a PWB: nothing is written outside
+// [dst, dst + n), the next bytes may belong to a live record.
+//
+// The kernel is chosen once, from CPUID and XGETBV (the OS must save the
+// registers). The instructions are written in assembly, the library is not
+// built with -mavx2 or -mavx512f.
+//-----------------------------------------------
+#define LINE 64
+
+typedef void (*lines_fn)(char *dst, const char *src, size_t lines);
+
+static int selected = NTCOPY_CACHED;
+static int supported[NTCOPY_KERNELS] = {1, 0, 0, 0};
+
+static const char *names[NTCOPY_KERNELS] = {"cached", "SSE2", "AVX2",
+                                            "AVX-512"};
+
+//-----------------------------------------------
+static void cpuid(unsigned int leaf, unsigned int *regs) {
+    __asm__("cpuid"
+            : "=a"(regs[0]), "=b"(regs[1]), "=c"(regs[2]), "=d"(regs[3])
+            : "a"(leaf), "c"(0));
+}
+
+//-----------------------------------------------
+static void detect(void) {
+    unsigned int regs[4];
+    cpuid(0, regs);
+    unsigned int max_leaf = regs[0];
+
+    cpuid(1, regs);
+    supported[NTCOPY_SSE2] = regs[3] >> 26 & 1;
+    int avx = regs[2] >> 28 & 1;
+    if (!(regs[2] >> 27 & 1) || !avx || max_leaf < 7) {
+        return;  // No OSXSAVE: no ymm / zmm state
+    }
+
+    unsigned int xcr0_lo, xcr0_hi;
+    __asm__("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+    cpuid(7, regs);
+    // XMM and YMM state
+    supported[NTCOPY_AVX2] = (xcr0_lo & 0x6) == 0x6 && (regs[1] >> 5 & 1);
+    // And opmask, ZMM0-15 upper halves, ZMM16-31
+    supported[NTCOPY_AVX512] =
+        (xcr0_lo & 0xe6) == 0xe6 && (regs[1] >> 16 & 1);
+}
+
+//-----------------------------------------------
+void ntcopy_init(int kernel) {
+    detect();
+    if (kernel < 0 || kernel >= NTCOPY_KERNELS || !supported[kernel]) {
+        for (kernel = NTCOPY_KERNELS - 1; !supported[kernel]; kernel--)
+            ;
+    }
+    selected = kernel;
+}
+
+//-----------------------------------------------
+int ntcopy_supported(int kernel) {
+    return kernel >= 0 && kernel < NTCOPY_KERNELS && supported[kernel];
+}
+
+//-----------------------------------------------
+int ntcopy_selected(void) { return selected; }
+
+//-----------------------------------------------
+const char *ntcopy_name(int kernel) {
+    return kernel >= 0 && kernel < NTCOPY_KERNELS ? names[kernel] : "none";
+}
+
+//-----------------------------------------------
+// Regular stores, then a PWB per line (none with eADR)
+//-----------------------------------------------
+static void copy_cached(char *dst, const char *src, size_t n) {
+    memcpy(dst, src, n);
+    if (!PWB_NEEDED) {
+        return;
+    }
+    for (uintptr_t line = (uintptr_t)dst & ~(uintptr_t)(LINE - 1);
+         line < (uintptr_t)dst + n; line += LINE) {
+        PWB((char *)line);
+    }
+}
+
+//-----------------------------------------------
+// The bodies: lines > 0, dst aligned on a line, src anywhere
+//-----------------------------------------------
+static void lines_sse2(char *dst, const char *src, size_t lines) {
+    __asm__ volatile(
+        "1:\n\t"
+        "movdqu (%1), %%xmm0\n\t"
+        "movdqu 16(%1), %%xmm1\n\t"
+        "movdqu 32(%1), %%xmm2\n\t"
+        "movdqu 48(%1), %%xmm3\n\t"
+        "movntdq %%xmm0, (%0)\n\t"
+        "movntdq %%xmm1, 16(%0)\n\t"
+        "movntdq %%xmm2, 32(%0)\n\t"
+        "movntdq %%xmm3, 48(%0)\n\t"
+        "add $64, %1\n\t"
+        "add $64, %0\n\t"
+        "dec %2\n\t"
+        "jnz 1b"
+        : "+r"(dst), "+r"(src), "+r"(lines)
+        :
+        : "xmm0", "xmm1", "xmm2", "xmm3", "memory", "cc");
+}
+
+//-----------------------------------------------
+static void lines_avx2(char *dst, const char *src, size_t lines) {
+    __asm__ volatile(
+        "1:\n\t"
+        "vmovdqu (%1), %%ymm0\n\t"
+        "vmovdqu 32(%1), %%ymm1\n\t"
+        "vmovntdq %%ymm0, (%0)\n\t"
+        "vmovntdq %%ymm1, 32(%0)\n\t"
+        "add $64, %1\n\t"
+        "add $64, %0\n\t"
+        "dec %2\n\t"
+        "jnz 1b\n\t"
+        "vzeroupper"  // No SSE/AVX transition penalty in the caller
+        : "+r"(dst), "+r"(src), "+r"(lines)
+        :
+        : "xmm0", "xmm1", "memory", "cc");
+}
+
+//-----------------------------------------------
+static void lines_avx512(char *dst, const char *src, size_t lines) {
+    __asm__ volatile(
+        "1:\n\t"
+        "vmovdqu64 (%1), %%zmm0\n\t"
+        "vmovntdq %%zmm0, (%0)\n\t"
+        "add $64, %1\n\t"
+        "add $64, %0\n\t"
+        "dec %2\n\t"
+        "jnz 1b\n\t"
+        "vzeroupper"
+        : "+r"(dst), "+r"(src), "+r"(lines)
+        :
+        : "xmm0", "memory", "cc");
+}
+
+static const lines_fn bodies[NTCOPY_KERNELS] = {NULL, lines_sse2, lines_avx2,
+                                                lines_avx512};
+
+//-----------------------------------------------
+void ntcopy_with(int kernel, void *_dst, const void *_src, size_t n) {
+    char *dst = _dst;
+    const char *src = _src;
+    if (kernel == NTCOPY_CACHED || !ntcopy_supported(kernel) || n < LINE) {
+        copy_cached(dst, src, n);
+        return;
+    }
+
+    size_t head = -(uintptr_t)dst & (LINE - 1);
+    if (head) {
+        copy_cached(dst, src, head);
+        dst += head;
+        src += head;
+        n -= head;
+    }
+    size_t lines = n / LINE;
+    if (lines) {
+        bodies[kernel](dst, src, lines);
+        dst += lines * LINE;
+        src += lines * LINE;
+        n -= lines * LINE;
+    }
+    if (n) {
+        copy_cached(dst, src, n);
+    }
+}
+
+//-----------------------------------------------
+void ntcopy(void *dst, const void *src, size_t n) {
+    ntcopy_with(n < NTCOPY_MIN ? NTCOPY_CACHED : selected, dst, src, n);
+}
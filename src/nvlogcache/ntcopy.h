@@ -0,0 +1,31 @@
+#pragma once
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Copy kernels of the log payloads, see ntcopy.c
+#define NTCOPY_AUTO -1    // The widest one the CPU has
+#define NTCOPY_CACHED 0   // memcpy, then a PWB per line
+#define NTCOPY_SSE2 1     // movntdq, 16 bytes
+#define NTCOPY_AVX2 2     // vmovntdq, 32 bytes
+#define NTCOPY_AVX512 3   // vmovntdq, 64 bytes
+#define NTCOPY_KERNELS 4
+
+// Below this, streaming does not pay for itself: ntcopy() uses the cached
+// copy (see make bench, obj/bench/ntcopy)
+#define NTCOPY_MIN 256
+
+void ntcopy_init(int kernel);
+int ntcopy_supported(int kernel);
+int ntcopy_selected(void);
+const char *ntcopy_name(int kernel);
+
+// Neither is ordered: the caller fences (PFENCE) before relying on the copy
+void ntcopy(void *dst, const void *src, size_t n);
+void ntcopy_with(int kernel, void *dst, const void *src, size_t n);
+
+#ifdef __cplusplus
+}
+#endif
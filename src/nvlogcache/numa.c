@@ -0,0 +1,72 @@
+#define _GNU_SOURCE
+#include "numa.h"
+#include <sys/syscall.h>
+#include <unistd.h>
+
+//-----------------------------------------------
+// Just what the RAM cache needs from NUMA, without libnuma: the nodes the
+// process may allocate on (get_mempolicy), the node of the calling thread,
+// and the placement of a range of memory (mbind). Only the first
+// NUMA_MAX_NODES nodes are used.
+//
+// mbind() only sets the policy of the range: it must be called before the
+// pages are first touched.
+//-----------------------------------------------
+#define NUMA_MAX_NODES 64
+#define NUMA_MASK_BITS 1024  // Larger than any kernel MAX_NUMNODES
+
+#define MPOL_BIND 2
+#define MPOL_INTERLEAVE 3
+#define MPOL_F_MEMS_ALLOWED (1 << 2)
+
+static int nb_nodes = 1;
+static int node_ids[NUMA_MAX_NODES];     // Kernel id of each node
+static int node_index[NUMA_MAX_NODES];   // And back
+static unsigned long all_nodes = 1;
+
+//-----------------------------------------------
+void numa_init(void) {
+    unsigned long mask[NUMA_MASK_BITS / 64] = {0};
+    if (syscall(SYS_get_mempolicy, NULL, mask, NUMA_MASK_BITS + 1, NULL,
+                MPOL_F_MEMS_ALLOWED) != 0 || mask[0] == 0) {
+        mask[0] = 1;  // Kernel without NUMA
+    }
+    nb_nodes = 0;
+    all_nodes = mask[0];
+    for (int n = 0; n < NUMA_MAX_NODES; n++) {
+        if (mask[0] >> n & 1) {
+            node_index[n] = nb_nodes;
+            node_ids[nb_nodes++] = n;
+        }
+    }
+}
+
+//-----------------------------------------------
+int numa_nodes(void) { return nb_nodes; }
+
+//-----------------------------------------------
+// Linux keeps (node << 12 | cpu) in TSC_AUX, as the vDSO getcpu() does: no
+// system call on the eviction path.
+//-----------------------------------------------
+int numa_local(void) {
+    if (nb_nodes == 1) {
+        return 0;
+    }
+    unsigned int lo, hi, aux;
+    __asm__ volatile("rdtscp" : "=a"(lo), "=d"(hi), "=c"(aux));
+    unsigned int node = aux >> 12;
+    return node < NUMA_MAX_NODES ? node_index[node] : 0;
+}
+
+//-----------------------------------------------
+int numa_interleave(void *addr, size_t len) {
+    return syscall(SYS_mbind, addr, len, MPOL_INTERLEAVE, &all_nodes,
+                   NUMA_MAX_NODES + 1, 0);
+}
+
+//-----------------------------------------------
+int numa_bind(void *addr, size_t len, int node) {
+    unsigned long mask = 1UL << node_ids[node];
+    return syscall(SYS_mbind, addr, len, MPOL_BIND, &mask, NUMA_MAX_NODES + 1,
+                   0);
+}
@@ -0,0 +1,18 @@
+#pragma once
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// NUMA placement of the RAM cache, see numa.c. Nodes are numbered from 0 to
+// numa_nodes() - 1 among the nodes the process may allocate on.
+void numa_init(void);
+int numa_nodes(void);
+int numa_local(void);
+int numa_interleave(void *addr, size_t len);
+int numa_bind(void *addr, size_t len, int node);
+
+#ifdef __cplusplus
+}
+#endif
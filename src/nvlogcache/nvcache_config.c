@@ -1,22 +1,42 @@
 #include "nvcache_config.h"
 #include "nvinfo.h"
+#include "pmem.h"
 #include <string.h>
 
 #ifndef NVCACHE_STATIC_CONF
 
   //default config
 long __ram_cache_size = 250000; // Around 1GB
-
-//long __log_size = 200000; // Around 800MB
-//long __log_size = 2000000; // Around 8GB
-long __log_size = 8000000; // Around 32GB
+int __ram_policy = RAM_POLICY_2Q;
+int __ram_shards = 0;      // One per online CPU
+int __readahead_pages = 32; // 128 KiB
+int __ram_hugepages = RAM_HUGEPAGES_THP;
+int __ram_numa = RAM_NUMA_NONE;
+
+//long __log_size = 800000000L; // 800MB
+//long __log_size = 8000000000L; // 8GB
+long __log_size = 32000000000L; // 32GB
+int __log_segments = 0;    // One per online CPU
+int __nt_copy = -1;        // Widest kernel of the CPU
 
 int __enable_recover = 0;
 int __flush_thread = 1;
+int __flush_threads = 1;  // Size of the flusher pool
+int __group_commit = 0;
 
 long __max_batch_size = 1000;
 long __min_batch_size = 400;
 
+int __flush_engine = FLUSH_ENGINE_SYNC;
+int __uring_depth = 64;
+int __write_back = WRITE_BACK_RECORDS;
+
+int __pmem_backend = PMEM_BACKEND_DAX;
+char *__pmem_path = NULL;   // Backend default, see pmem_default_path()
+long __pwb_latency = -1;    // Backend default
+long __pfence_latency = -1; // Backend default
+int __pwb = PWB_AUTO;       // From CPUID and the NVDIMM regions
+
 
 
 
@@ -33,14 +53,34 @@ long getenv_num(const char *name){
 void print_config(){
   printinfo(NVINFO, RED"== Config =="RST);
   printinfo(NVINFO,"RAM CACHE SIZE = %ld", __ram_cache_size);
+  printinfo(NVINFO,"RAM POLICY = %s (%d shards)",
+	    __ram_policy == RAM_POLICY_2Q ? "2Q" : "CLOCK", __ram_shards);
+  printinfo(NVINFO,"READAHEAD = %d pages", __readahead_pages);
+  printinfo(NVINFO,"RAM HUGEPAGES = %d", __ram_hugepages);
+  printinfo(NVINFO,"RAM NUMA = %d", __ram_numa);
   printinfo(NVINFO,"-------------------");
-  printinfo(NVINFO,"LOG SIZE = %ld", __log_size);
+  printinfo(NVINFO,"LOG SIZE = %ld bytes", __log_size);
+  printinfo(NVINFO,"LOG SEGMENTS = %d", __log_segments);
+  printinfo(NVINFO,"NT COPY = %d", __nt_copy);
   printinfo(NVINFO,"-------------------");
   printinfo(NVINFO,"MAX BATCH SIZE = %ld", __max_batch_size);
   printinfo(NVINFO,"MIN BATCH SIZE = %ld", __min_batch_size);
+  printinfo(NVINFO,"FLUSH ENGINE = %s (depth %d)",
+	    __flush_engine == FLUSH_ENGINE_URING ? "io_uring" : "sync",
+	    __uring_depth);
+  printinfo(NVINFO,"WRITE BACK = %s",
+	    __write_back == WRITE_BACK_PAGES ? "pages" : "records");
   printinfo(NVINFO,"-------------------");
   printinfo(NVINFO,"ENABLE RECOVER = %d", __enable_recover);
-  printinfo(NVINFO,"FLUSH THREAD = %d", __flush_thread);
+  printinfo(NVINFO,"FLUSH THREAD = %d (%d threads)", __flush_thread,
+	    __flush_threads);
+  printinfo(NVINFO,"GROUP COMMIT = %d", __group_commit);
+  printinfo(NVINFO,"-------------------");
+  printinfo(NVINFO,"PMEM BACKEND = %s", pmem_backend_name(__pmem_backend));
+  printinfo(NVINFO,"PMEM PATH = %s", __pmem_path ? __pmem_path : "none");
+  printinfo(NVINFO,"PWB LATENCY = %ld ns", __pwb_latency);
+  printinfo(NVINFO,"PFENCE LATENCY = %ld ns", __pfence_latency);
+  printinfo(NVINFO,"PWB = %d", __pwb);
   
   printinfo(NVINFO,"============");
 }
@@ -64,20 +104,60 @@ void configure_param_long(long *value, const char *env_var){
 }
 
 
+void configure_param_str(char **value, const char *env_var){
+  char *str = getenv(env_var);
+  if(str!=NULL && str[0]!=0){
+    *value = str;
+  }
+  // Else : default value in nvcache_config.h
+}
+
+
 void nvcache_config_init(){
 
   
   //Read environment vars
   configure_param_long(&__ram_cache_size, "NVCACHE_RAM_CACHE_SIZE");
+  configure_param_int(&__ram_policy, "NVCACHE_RAM_POLICY");
+  configure_param_int(&__ram_shards, "NVCACHE_RAM_SHARDS");
+  configure_param_int(&__readahead_pages, "NVCACHE_READAHEAD");
+  configure_param_int(&__ram_hugepages, "NVCACHE_RAM_HUGEPAGES");
+  configure_param_int(&__ram_numa, "NVCACHE_RAM_NUMA");
   
   configure_param_long(&__log_size, "NVCACHE_LOG_SIZE");
+  configure_param_int(&__log_segments, "NVCACHE_LOG_SEGMENTS");
+  configure_param_int(&__nt_copy, "NVCACHE_NT_COPY");
   
   configure_param_int(&__enable_recover, "NVCACHE_ENABLE_RECOVER");
   configure_param_int(&__flush_thread, "NVCACHE_FLUSH_THREAD");
+  configure_param_int(&__flush_threads, "NVCACHE_FLUSH_THREADS");
+  configure_param_int(&__group_commit, "NVCACHE_GROUP_COMMIT");
 
   configure_param_long(&__max_batch_size, "NVCACHE_MAX_BATCH_SIZE");
   configure_param_long(&__min_batch_size, "NVCACHE_MIN_BATCH_SIZE");
 
+  configure_param_int(&__flush_engine, "NVCACHE_FLUSH_ENGINE");
+  configure_param_int(&__uring_depth, "NVCACHE_URING_DEPTH");
+  configure_param_int(&__write_back, "NVCACHE_WRITE_BACK");
+
+  configure_param_int(&__pmem_backend, "NVCACHE_PMEM_BACKEND");
+  configure_param_str(&__pmem_path, "NVCACHE_PMEM_PATH");
+  configure_param_long(&__pwb_latency, "NVCACHE_PWB_LATENCY");
+  configure_param_long(&__pfence_latency, "NVCACHE_PFENCE_LATENCY");
+  configure_param_int(&__pwb, "NVCACHE_PWB");
+
+  // Latency injection only makes sense when PMEM is emulated
+  int emulated = (__pmem_backend != PMEM_BACKEND_DAX);
+  if(__pmem_path==NULL){
+    __pmem_path = pmem_default_path(__pmem_backend);
+  }
+  if(__pwb_latency<0){
+    __pwb_latency = emulated ? PMEM_EMUL_PWB_NS : 0;
+  }
+  if(__pfence_latency<0){
+    __pfence_latency = emulated ? PMEM_EMUL_PFENCE_NS : 0;
+  }
+
 
   print_config();
   
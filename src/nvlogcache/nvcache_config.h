@@ -9,20 +9,44 @@
 #ifndef NVCACHE_STATIC_CONF
 //=================DYNAMIC CONFIG=========================
 extern long __ram_cache_size;
+extern int __ram_policy;
+extern int __ram_shards;
+extern int __readahead_pages;
+extern int __ram_hugepages;
+extern int __ram_numa;
 
 extern long __log_size;
+extern int __log_segments;
+extern int __nt_copy;
 
 extern int __enable_recover;
 extern int __flush_thread;
+extern int __flush_threads;
+extern int __group_commit;
 
 extern long __max_batch_size;
 extern long __min_batch_size;
 
+extern int __flush_engine;
+extern int __uring_depth;
+extern int __write_back;
+
+extern int __pmem_backend;
+extern char *__pmem_path;
+extern long __pwb_latency;
+extern long __pfence_latency;
+extern int __pwb;
+
 //------------------------------
 //        RAM CACHE
 //------------------------------
 
 #define RAM_CACHE_SIZE __ram_cache_size  // pages
+#define RAM_POLICY __ram_policy
+#define RAM_SHARDS __ram_shards  // 0 : one per online CPU
+#define READAHEAD_PAGES __readahead_pages  // Largest readahead, 1 disables it
+#define RAM_HUGEPAGES __ram_hugepages  // Huge pages for the cache arena
+#define RAM_NUMA __ram_numa  // Placement of the cache arena on the nodes
 
 #ifndef NVCACHE_RAM_PAGE_SIZE_K
 #define RAM_PAGE_SIZE 4096 // Bytes
@@ -35,26 +59,45 @@ extern long __min_batch_size;
 //          NVLOG
 //------------------------------
 
-#define LOG_SIZE __log_size
+#define LOG_SIZE __log_size  // bytes
+#define LOG_SEGMENTS __log_segments  // 0 : one per online CPU
+#define NT_COPY __nt_copy  // Payload copy kernel, -1 : the widest (ntcopy.h)
 
 #ifndef NVCACHE_ENTRY_SIZE_K
-#define LOGENTRY_SIZE 4096 // Must be set by a define.
+#define LOGENTRY_SIZE 4096 // Largest record payload. Must be set by a define.
 #else
 #define LOGENTRY_SIZE (NVCACHE_ENTRY_SIZE_K*1024L)
 #endif
 
-// PWB must be defined at compile time.
-#define PWB_IS_CLWB
-//#define PWB_IS_CLFLUSHOPT
-//#define PWB_IS_NOP
+// PWB is chosen at startup (see pmem.c), or forced with NVCACHE_PWB
+#define PWB_IS_RUNTIME
+#define PWB_INSN __pwb
 
 #define ENABLE_RECOVER __enable_recover
 
 #define FLUSH_THREAD __flush_thread
+#define FLUSH_THREADS __flush_threads  // Size of the flusher pool
+#define GROUP_COMMIT __group_commit  // Small writes logged by a combiner
 
 #define MAX_BATCH_SIZE __max_batch_size
 #define MIN_BATCH_SIZE __min_batch_size
 
+#define FLUSH_ENGINE __flush_engine
+#define URING_DEPTH __uring_depth  // In-flight writes with FLUSH_ENGINE_URING
+#define WRITE_BACK __write_back  // Records, or pages of the RAM cache
+
+//------------------------------
+//        PMEM BACKEND
+//------------------------------
+
+#define PMEM_BACKEND __pmem_backend
+#define PMEM_PATH __pmem_path
+
+// Injected after each PWB / PFENCE (ns). Only the emulated backends
+// (file, dram) get a non-zero default.
+#define PWB_LATENCY __pwb_latency
+#define PFENCE_LATENCY __pfence_latency
+
 
 
 //=================STATIC CONFIG=========================
@@ -68,6 +111,11 @@ extern long __min_batch_size;
 
 #define RAM_CACHE_SIZE 50000  // pages
 #define RAM_PAGE_SIZE 4096     // bytes
+#define RAM_POLICY RAM_POLICY_2Q
+#define RAM_SHARDS 0
+#define READAHEAD_PAGES 32
+#define RAM_HUGEPAGES RAM_HUGEPAGES_THP
+#define RAM_NUMA RAM_NUMA_NONE
 #define MAX_FILES 1024
 
 
@@ -79,6 +127,9 @@ extern long __min_batch_size;
 //#define MEDIUM_LOG
 //#define SMALL_LOG
 
+#define LOG_SEGMENTS 0
+#define NT_COPY -1
+
 #define PWB_IS_CLWB
 //#define PWB_IS_CLFLUSHOPT
 //#define PWB_IS_NOP
@@ -86,70 +137,165 @@ extern long __min_batch_size;
 //#define ENABLE_RECOVER
 
 #define FLUSH_THREAD
+#define FLUSH_THREADS 1
+#define GROUP_COMMIT 0
 
 #define MAX_BATCH_SIZE 120000
 #define MIN_BATCH_SIZE 1
 
+#define FLUSH_ENGINE FLUSH_ENGINE_SYNC
+#define URING_DEPTH 64
+#define WRITE_BACK WRITE_BACK_RECORDS
+
 #define LOGENTRY_SIZE 8192  // One complete page at maximum
 #define MAX_FD 50           // Max number of fd used simultaneously
 
+#define PMEM_BACKEND PMEM_BACKEND_DAX
+#define PMEM_PATH "/dev/dax1.0"
+#define PWB_LATENCY 0
+#define PFENCE_LATENCY 0
+
 #endif //NVCACHE_STATIC_CONF
 
 
+//------------------------------
+//  RAM POLICIES (see ram_policy.c)
+//------------------------------
+#define RAM_POLICY_CLOCK 0  // Sharded CLOCK
+#define RAM_POLICY_2Q 1     // Sharded CLOCK with hot/cold queues, scan-resistant
+
+//------------------------------
+//  RAM ARENA (see nvcache_ram.c)
+//------------------------------
+#define RAM_HUGEPAGES_NONE 0     // 4 KiB pages
+#define RAM_HUGEPAGES_THP 1      // Transparent huge pages, madvise()
+#define RAM_HUGEPAGES_HUGETLB 2  // Reserved huge pages, else THP
+#define RAM_NUMA_NONE 0        // First touch
+#define RAM_NUMA_INTERLEAVE 1  // Pages interleaved on all the nodes
+#define RAM_NUMA_SPLIT 2       // One part per node, node-local victims
+
+//------------------------------
+//   FLUSH ENGINES (see nvlog.c)
+//------------------------------
+#define FLUSH_ENGINE_SYNC 0   // pwritev then fsync, one at a time
+#define FLUSH_ENGINE_URING 1  // io_uring, a whole batch in flight
+
+//------------------------------
+//   WRITE-BACK MODES (see nvlog.c)
+//------------------------------
+#define WRITE_BACK_RECORDS 0  // The bytes of each record
+#define WRITE_BACK_PAGES 1    // The image of each dirty page in RAM, once
+
+//------------------------------
+//   PWB INSTRUCTIONS (see pmem.c)
+//------------------------------
+#define PWB_AUTO -1       // The best one the CPU has, none with eADR
+#define PWB_CLFLUSH 0     // Evicts the line, ordered by itself
+#define PWB_CLFLUSHOPT 1  // Evicts the line, ordered by PFENCE
+#define PWB_CLWB 2        // Writes the line back and keeps it, same
+#define PWB_NONE 3        // The caches are persistent (eADR)
+
+//------------------------------
+//   PMEM BACKENDS (see pmem.c)
+//------------------------------
+#define PMEM_BACKEND_DAX 0   // DAX device (or file on a DAX fs), MAP_SYNC
+#define PMEM_BACKEND_FILE 1  // Regular file (tmpfs, ext4...), emulated
+#define PMEM_BACKEND_DRAM 2  // Anonymous memory, emulated, nothing survives
+
+// Default emulated costs, close to what we measured on Optane DCPMM
+#define PMEM_EMUL_PWB_NS 30
+#define PMEM_EMUL_PFENCE_NS 90
+
+void pmem_inject_latency(long ns);
+#define PMEM_LATENCY(ns)                      \
+    do {                                      \
+        if (ns) pmem_inject_latency(ns);      \
+    } while (0)
+
+
 // Thank you Pedro for this part :-) (from OneFile)
 //-------------------------------
 #if defined(PWB_IS_CLFLUSH)
 
-#define PWB(addr)                               \
+#define __PWB(addr)                             \
     __asm__ volatile("clflush (%0)" ::"r"(addr) \
                      : "memory")  // Broadwell only works with this.
-#define PFENCE() \
+#define __PFENCE() \
     {}  // No ordering fences needed for CLFLUSH (section 7.4.6 of Intel manual)
-#define PSYNC() \
+#define __PSYNC() \
     {}  // For durability it's not obvious, but CLFLUSH seems to be enough, and
         // PMDK uses the same approach
+#define PWB_NEEDED 1
 
 #elif defined(PWB_IS_CLWB)
 /* Use this for CPUs that support clwb, such as the SkyLake SP series (c5
  * compute intensive instances in AWS are an example of it) */
-#define PWB(addr)                 \
+#define __PWB(addr)               \
     __asm__ volatile(             \
         ".byte 0x66; xsaveopt %0" \
-        : "+m"(*(volatile char *)(addr)))  // clwb() only for Ice Lake onwards
-#define PFENCE() __asm__ volatile("sfence" : : : "memory")
-#define PSYNC() __asm__ volatile("sfence" : : : "memory")
+        : "+m"(*(volatile char *)(addr)))  // 66 0F AE /6: clwb
+#define __PFENCE() __asm__ volatile("sfence" : : : "memory")
+#define __PSYNC() __asm__ volatile("sfence" : : : "memory")
+#define PWB_NEEDED 1
 
 #elif defined(PWB_IS_NOP)
 /* pwbs are not needed for shared memory persistency (i.e. persistency across
  * process failure) */
-#define PWB(addr) \
+#define __PWB(addr) \
     {}
-#define PFENCE() __asm__ volatile("sfence" : : : "memory")
-#define PSYNC() __asm__ volatile("sfence" : : : "memory")
+#define __PFENCE() __asm__ volatile("sfence" : : : "memory")
+#define __PSYNC() __asm__ volatile("sfence" : : : "memory")
+#define PWB_NEEDED 0
 
 #elif defined(PWB_IS_CLFLUSHOPT)
 /* Use this for CPUs that support clflushopt, which is most recent x86 */
-#define PWB(addr)                \
+#define __PWB(addr)              \
     __asm__ volatile(            \
         ".byte 0x66; clflush %0" \
-        : "+m"(*(volatile char *)(addr)))  // clflushopt (Kaby Lake)
-#define PFENCE() __asm__ volatile("sfence" : : : "memory")
-#define PSYNC() __asm__ volatile("sfence" : : : "memory")
+        : "+m"(*(volatile char *)(addr)))  // 66 0F AE /7: clflushopt
+#define __PFENCE() __asm__ volatile("sfence" : : : "memory")
+#define __PSYNC() __asm__ volatile("sfence" : : : "memory")
+#define PWB_NEEDED 1
+
+#elif defined(PWB_IS_RUNTIME)
+/* One of the above, chosen once in PWB_INSN. The fences are kept with
+ * clflush and eADR: they still order the non-temporal stores. */
+#define __PWB(addr)                                             \
+    do {                                                        \
+        if (PWB_INSN == PWB_CLWB)                               \
+            __asm__ volatile(".byte 0x66; xsaveopt %0"          \
+                             : "+m"(*(volatile char *)(addr))); \
+        else if (PWB_INSN == PWB_CLFLUSHOPT)                    \
+            __asm__ volatile(".byte 0x66; clflush %0"           \
+                             : "+m"(*(volatile char *)(addr))); \
+        else if (PWB_INSN == PWB_CLFLUSH)                       \
+            __asm__ volatile("clflush %0"                       \
+                             : "+m"(*(volatile char *)(addr))); \
+    } while (0)
+#define __PFENCE() __asm__ volatile("sfence" : : : "memory")
+#define __PSYNC() __asm__ volatile("sfence" : : : "memory")
+#define PWB_NEEDED (PWB_INSN != PWB_NONE)  // Else, skip the flush loops
 #else
 #error \
     "You must define what PWB is. Choose PWB_IS_CLFLUSHOPT if you don't know what your CPU is capable of"
 
 #endif
 
-/*#define ntstore(_dst, _src)		    \
-  unsigned long dst = (unsigned long) _dst; \
-  unsigned long src = (unsigned long) _src; \
-  asm("movq    (%0), %%r8\n" \
-      "movnti  %%r8,   (%1)\n" \
-      :: "r" (src), "r" (dst) \
-      : "memory", "r8");*/
-
-
+#define PWB(addr)                      \
+    do {                               \
+        __PWB(addr);                   \
+        PMEM_LATENCY(PWB_LATENCY);     \
+    } while (0)
+#define PFENCE()                       \
+    do {                               \
+        __PFENCE();                    \
+        PMEM_LATENCY(PFENCE_LATENCY);  \
+    } while (0)
+#define PSYNC()                        \
+    do {                               \
+        __PSYNC();                     \
+        PMEM_LATENCY(PFENCE_LATENCY);  \
+    } while (0)
 
 void nvcache_config_init(void);  
 
@@ -302,12 +302,22 @@ ssize_t nvcache_pwrite(int fd, const void *buf, size_t size, off_t offset) {
     
 #endif
 
+    // Logged first: a page missed meanwhile is either filled after the
+    // record is visible, or cached early enough to be updated here (see
+    // fill_page())
+    nvlog_add_entry(fd, offset, buf, size);
+
     // Update the RAM cache
     if (!is_writeonly(fd)) {
         ret = ramcache_pwrite(fd, offset, buf, size);
     }
-    
-    nvlog_add_entry(fd, offset, buf, size);
+
+#ifndef USE_LINUXCACHE
+    // Counted by the log since the commit (see count_write() @nvlog.c)
+    if (WRITE_BACK == WRITE_BACK_PAGES && !is_writeonly(fd)) {
+        ramcache_write_end(fd, offset, size);
+    }
+#endif
 
 #ifdef USE_LINUXCACHE
     ret = musl_pwrite(fd, buf, size, offset);
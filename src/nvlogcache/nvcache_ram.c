@@ -1,13 +1,20 @@
+#define _GNU_SOURCE
 #include "nvcache_ram.h"
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include "ebr.h"
 #include "internal_profile.h"
 #include "nvinfo.h"
+#include "numa.h"
 #include "nvlog.h"
 #include "radix-tree.h"
+#include "ram_policy.h"
 
 
 #define TRACE_ADD 0x1
@@ -19,6 +26,15 @@
 #define TRACE_UNLOCK 0x30
 #define TRACE_TRYLOCK 0x40
 
+// Most pages read at once, their victims and iovecs are on the stack
+#define READ_PAGES_LIMIT 256
+
+// MAP_HUGETLB size (the default one of x86-64)
+#define HUGE_PAGE_SIZE (2L << 20)
+
+// Most parts of the cache with RAM_NUMA_SPLIT, one per node
+#define NUMA_MAX_PARTS 64
+
 static int tracemask = 0;
   //TRACE_LOCK | TRACE_UNLOCK | TRACE_TRYLOCK | TRACE_ADD | TRACE_EVICT | TRACE_MISS | TRACE_DIRTY_MISS;
 
@@ -26,36 +42,53 @@ static int tracemask = 0;
 //           NOT EXPORTED
 //-----------------------------------------------
 static int trace(int bit);
-static pthread_mutex_t lru_lock;
-static void pagetable_init();
-static void page_init(page *p, page *prev, page *next);
+static void *arena_map(size_t size, int hugepages);
+static int arena_split(long *parts);
 static page *get_page(int fd, off_t offset);
 static page *__get_page(int fd, off_t offset);
 static page *dirty_miss(page *p, int fd, size_t offset);
 static page *cache_miss(int fd, off_t offset);
 static page *__cache_miss(int fd, off_t offset);
-static page *add_page(off_t offset, ssize_t size, char *buf, radixcache *cache);
-static page *__add_page(off_t offset, ssize_t size, char *buf, radixcache *cache);
-static page *rm_last_page();
+static long readahead_pages(radixcache *cache, off_t base);
+static long readahead_lock(int fd, off_t base, long window);
+static long max_read_pages(void);
+static page *read_pages(int fd, off_t base, long nb);
+static void fill_range(int fd, off_t offset, size_t size);
+static void fill_run(int fd, off_t base, long nb);
+static page *fill_page(int fd, page *p, off_t offset, ssize_t size);
+static page *add_page(page *newpage, off_t offset, ssize_t size,
+                      radixcache *cache);
+static page *__add_page(page *newpage, off_t offset, ssize_t size,
+                        radixcache *cache);
+static void drop_page(page *p);
+static page *evict_page(int fd, off_t offset);
 static size_t page_read(int fd, off_t offset, char *buf, size_t nbyte);
 static size_t page_write(int fd, off_t offset, const char *buf, size_t nbyte);
+static void add_writers(int fd, off_t offset, size_t size, int n);
 static off_t page_busy(off_t offset);
 static off_t page_free(off_t offset);
 static off_t page_base(off_t offset);
+static radix_tree *tree_of(int fd);
+static int __ramcache_lock_radix_page(int fd, off_t offset);
+static int __ramcache_trylock_radix_pages(int fd, off_t offset, int size);
+static int __ramcache_unlock_radix_page(int fd, off_t offset);
+static void release_radixcache(void *cache);
 
 //-----------------------------------------------
 //               INIT
 //-----------------------------------------------
 void ramcache_init() {
-    ramcache.page_table=malloc(RAM_CACHE_SIZE*sizeof(page));
+    long parts[NUMA_MAX_PARTS + 1];
+    // A huge page would hold 65536 descriptors, THP at most
+    ramcache.page_table = arena_map(RAM_CACHE_SIZE * sizeof(page),
+                                    RAM_HUGEPAGES ? RAM_HUGEPAGES_THP : 0);
+    ramcache.payloads = arena_map(RAM_CACHE_SIZE * RAM_PAGE_SIZE, RAM_HUGEPAGES);
+    // Before the first touch. The descriptors are then initialized by the
+    // policy, the first time it hands them out.
+    int nb_parts = arena_split(parts);
     radix_init_nodes(RAM_CACHE_SIZE);
-    pagetable_init();
-
-    pthread_mutex_init(&lru_lock, NULL);
+    policy_init(ramcache.page_table, parts, nb_parts);
 
-
-    ramcache.first = &ramcache.page_table[0];
-    ramcache.last = &ramcache.page_table[RAM_CACHE_SIZE - 1];
     ramcache.hits = 0;
     ramcache.misses = 0;
     ramcache.overlaps = 0;
@@ -74,28 +107,83 @@ void ramcache_init() {
 }
 
 //-----------------------------------------------
-void pagetable_init() {
-    page_init(&ramcache.page_table[0], NULL, &ramcache.page_table[1]);
-
-    for (int i = 1; i < RAM_CACHE_SIZE - 1; i++) {
-        page_init(&ramcache.page_table[i], &ramcache.page_table[i - 1],
-                  &ramcache.page_table[i + 1]);
+// Anonymous memory, on huge pages as asked if the kernel allows: reserved
+// ones (hugetlbfs pool) first, else transparent ones (madvise mode).
+//-----------------------------------------------
+void *arena_map(size_t size, int hugepages) {
+    void *arena = MAP_FAILED;
+    if (hugepages == RAM_HUGEPAGES_HUGETLB) {
+        // Reserved now (no MAP_NORESERVE): a short pool fails here rather
+        // than faulting on first touch
+        size_t huge_size = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+        arena = mmap(NULL, huge_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (arena == MAP_FAILED) {
+            printinfo(NVWARN, "RAM cache: no reserved huge pages (%s)",
+                      strerror(errno));
+            hugepages = RAM_HUGEPAGES_THP;
+        }
     }
-
-    page_init(&ramcache.page_table[RAM_CACHE_SIZE - 1],
-              &ramcache.page_table[RAM_CACHE_SIZE - 2], NULL);
+    if (arena == MAP_FAILED) {
+        arena = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    }
+    if (arena == MAP_FAILED) {
+        perror("RAM cache mmap");
+        exit(EXIT_FAILURE);
+    }
+    if (hugepages == RAM_HUGEPAGES_THP &&
+        madvise(arena, size, MADV_HUGEPAGE)) {
+        printinfo(NVWARN, "RAM cache: no transparent huge pages (%s)",
+                  strerror(errno));
+    }
+    return arena;
 }
 
 //-----------------------------------------------
-void page_init(page *p, page *prev, page *next) {
-    p->next = next;
-    p->previous = prev;
-    p->fd = -1;
-    p->offset = 0;
-    p->state = CLEAN;
-    p->size = 0;
-    p->touched = 0;
-    p->radix_parent = NULL;
+// Places the arenas on the NUMA nodes as RAM_NUMA says. With RAM_NUMA_SPLIT,
+// part i of the cache (pages parts[i] to parts[i + 1]) is bound to node i;
+// the parts start on huge page boundaries of the payloads (and page
+// boundaries of the descriptors). Returns the number of parts.
+//-----------------------------------------------
+int arena_split(long *parts) {
+    numa_init();
+    int nb_parts = RAM_NUMA == RAM_NUMA_SPLIT ? numa_nodes() : 1;
+    long align = max(HUGE_PAGE_SIZE / RAM_PAGE_SIZE,
+                     (long)(PAGE_SIZE / sizeof(page)));
+    if (nb_parts > NUMA_MAX_PARTS) {
+        nb_parts = NUMA_MAX_PARTS;
+    }
+    if (nb_parts > RAM_CACHE_SIZE / align) {
+        nb_parts = max(RAM_CACHE_SIZE / align, 1);
+    }
+    for (int i = 0; i < nb_parts; i++) {
+        parts[i] = RAM_CACHE_SIZE * i / nb_parts / align * align;
+    }
+    parts[nb_parts] = RAM_CACHE_SIZE;
+
+    int ret = 0;
+    if (RAM_NUMA == RAM_NUMA_INTERLEAVE) {
+        ret |= numa_interleave(ramcache.page_table,
+                               RAM_CACHE_SIZE * sizeof(page));
+        ret |= numa_interleave(ramcache.payloads,
+                               RAM_CACHE_SIZE * RAM_PAGE_SIZE);
+    } else if (RAM_NUMA == RAM_NUMA_SPLIT) {
+        for (int i = 0; i < nb_parts; i++) {
+            long nb = parts[i + 1] - parts[i];
+            ret |= numa_bind(ramcache.page_table + parts[i], nb * sizeof(page),
+                             i);
+            ret |= numa_bind(ramcache.payloads + parts[i] * RAM_PAGE_SIZE,
+                             nb * RAM_PAGE_SIZE, i);
+        }
+    }
+    if (ret) {
+        printinfo(NVWARN, "RAM cache: NUMA placement failed (%s)",
+                  strerror(errno));
+    }
+    printinfo(NVINFO, GRN "\tNUMA : %d nodes, %d parts" RST, numa_nodes(),
+              nb_parts);
+    return nb_parts;
 }
 
 //-----------------------------------------------
@@ -109,26 +197,43 @@ off_t page_free(off_t offset) { return RAM_PAGE_SIZE - page_busy(offset); }
 //-----------------------------------------------
 off_t page_base(off_t offset) { return offset - page_busy(offset); }
 
+//-----------------------------------------------
+// The radix tree of fd, NULL if it is not cached. Radix trees are read
+// without locks and released through ebr_retire() when their file is
+// closed: the tree is only valid between ebr_enter() and ebr_exit().
+//-----------------------------------------------
+radix_tree *tree_of(int fd) {
+    radixcache *cache =
+        atomic_load_explicit(&ramcache.cache_table[fd], memory_order_acquire);
+    return cache != NULL ? cache->tree : NULL;
+}
+
 //-----------------------------------------------
 //             SYNCHRONISATION
 //-----------------------------------------------
 int ramcache_lock_radix_page(int fd, off_t offset) {
-    if (ramcache.cache_table[fd] != NULL) {
-        radix_tree *tree = ramcache.cache_table[fd]->tree;
-        if (tree != NULL) {
-            int lockret = radix_lock_page(offset, tree);
-            if (lockret) {
-                printf("ERROR : Lock failed !\n");
-                perror("Lock");
-                // exit(EXIT_FAILURE);
-            }
-            if (trace(TRACE_LOCK)) {
-                printinfo(NVTRACE,
-                          BLU "|    Locked    | fd=%2d | off=%8ld |" RST, fd,
-                          page_base(offset));
-            }
-            return lockret;
+    int ebr = ebr_enter();
+    int ret = __ramcache_lock_radix_page(fd, offset);
+    ebr_exit(ebr);
+    return ret;
+}
+
+//-----------------------------------------------
+int __ramcache_lock_radix_page(int fd, off_t offset) {
+    radix_tree *tree = tree_of(fd);
+    if (tree != NULL) {
+        int lockret = radix_lock_page(offset, tree);
+        if (lockret) {
+            printf("ERROR : Lock failed !\n");
+            perror("Lock");
+            // exit(EXIT_FAILURE);
+        }
+        if (trace(TRACE_LOCK)) {
+            printinfo(NVTRACE,
+                      BLU "|    Locked    | fd=%2d | off=%8ld |" RST, fd,
+                      page_base(offset));
         }
+        return lockret;
     }
 
     printf("Failed to lock, fd=%d off=%ld\n", fd, offset);
@@ -137,60 +242,66 @@ int ramcache_lock_radix_page(int fd, off_t offset) {
 
 //-----------------------------------------------
 int ramcache_trylock_radix_pages(int fd, off_t offset, int size) {
-    if (ramcache.cache_table[fd] != NULL) {
-        radix_tree *tree = ramcache.cache_table[fd]->tree;
-        if (tree != NULL) {
-            int nbpages = 1 + ((size - 1 + page_busy(offset)) / RAM_PAGE_SIZE);
+    int ebr = ebr_enter();
+    int ret = __ramcache_trylock_radix_pages(fd, offset, size);
+    ebr_exit(ebr);
+    return ret;
+}
 
-            offset = page_base(offset);
-            if (trace(TRACE_TRYLOCK)) {
-                printinfo(NVTRACE, "");
-                printinfo(NVTRACE,
-                          WHT
-                          "| START TRYLOCK| fd=%2d | off=%8ld | size=%6d | "
-                          "nbpages=%d" RST,
-                          fd, offset, size, nbpages);
-            }
+//-----------------------------------------------
+int __ramcache_trylock_radix_pages(int fd, off_t offset, int size) {
+    radix_tree *tree = tree_of(fd);
+    if (tree != NULL) {
+        int nbpages = 1 + ((size - 1 + page_busy(offset)) / RAM_PAGE_SIZE);
+
+        offset = page_base(offset);
+        if (trace(TRACE_TRYLOCK)) {
+            printinfo(NVTRACE, "");
+            printinfo(NVTRACE,
+                      WHT
+                      "| START TRYLOCK| fd=%2d | off=%8ld | size=%6d | "
+                      "nbpages=%d" RST,
+                      fd, offset, size, nbpages);
+        }
 
-            int locked = 0;
-            for (int i = 0; i < nbpages; i++) {
-                int ret = radix_trylock_page(offset + (i * RAM_PAGE_SIZE),
-                                             ramcache.cache_table[fd]->tree);
-                if (!ret) {
-                    ++locked;
-                    if (trace(TRACE_TRYLOCK)) {
-                        printinfo(NVTRACE,
-                                  WHT
-                                  "|  Trylock OK  | fd=%2d | off=%8ld |" RST,
-                                  fd, offset + (i * RAM_PAGE_SIZE));
-                    }
-                } else {
-                    if (trace(TRACE_TRYLOCK)) {
-                        printinfo(NVTRACE,
-                                  RED
-                                  "| Trylock Fail | fd=%2d | off=%8ld |" RST,
-                                  fd, offset + (i * RAM_PAGE_SIZE));
-                    }
-                    for (int j = 0; j < locked; j++) {
-                        radix_unlock_page(offset + (j * RAM_PAGE_SIZE),
-                                          ramcache.cache_table[fd]->tree);
-                    }
-                    break;
-                }
-            }
-            if (locked == nbpages) {
+        int locked = 0;
+        for (int i = 0; i < nbpages; i++) {
+            int ret = radix_trylock_page(offset + (i * RAM_PAGE_SIZE),
+                                         tree);
+            if (!ret) {
+                ++locked;
                 if (trace(TRACE_TRYLOCK)) {
                     printinfo(NVTRACE,
                               WHT
-                              "|END TRYLOCK OK| fd=%2d | off=%8ld | size=%6d | "
-                              "nbpages=%d" RST,
-                              fd, offset, size, nbpages);
+                              "|  Trylock OK  | fd=%2d | off=%8ld |" RST,
+                              fd, offset + (i * RAM_PAGE_SIZE));
                 }
-                return 0;  // Success
             } else {
-                return 1;
+                if (trace(TRACE_TRYLOCK)) {
+                    printinfo(NVTRACE,
+                              RED
+                              "| Trylock Fail | fd=%2d | off=%8ld |" RST,
+                              fd, offset + (i * RAM_PAGE_SIZE));
+                }
+                for (int j = 0; j < locked; j++) {
+                    radix_unlock_page(offset + (j * RAM_PAGE_SIZE),
+                                      tree);
+                }
+                break;
             }
         }
+        if (locked == nbpages) {
+            if (trace(TRACE_TRYLOCK)) {
+                printinfo(NVTRACE,
+                          WHT
+                          "|END TRYLOCK OK| fd=%2d | off=%8ld | size=%6d | "
+                          "nbpages=%d" RST,
+                          fd, offset, size, nbpages);
+            }
+            return 0;  // Success
+        } else {
+            return 1;
+        }
     }
     if (trace(TRACE_TRYLOCK)) {
         printinfo(NVTRACE,
@@ -202,23 +313,29 @@ int ramcache_trylock_radix_pages(int fd, off_t offset, int size) {
 
 //-----------------------------------------------
 int ramcache_unlock_radix_page(int fd, off_t offset) {
-    if (ramcache.cache_table[fd] != NULL) {
-        radix_tree *tree = ramcache.cache_table[fd]->tree;
-        if (tree != NULL) {
-            int lockret = radix_unlock_page(offset, tree);
-            if (lockret) {
-                printf("ERROR : Failed unlock fd=%d off=%ld error=%d\n", fd,
-                       offset, lockret);
-                perror("Unlock");
-                // exit(EXIT_FAILURE);
-            }
-            if (trace(TRACE_UNLOCK)) {
-                printinfo(NVTRACE,
-                          GRN "|   Unlocked   | fd=%2d | off=%8ld |" RST, fd,
-                          page_base(offset));
-            }
-            return lockret;
+    int ebr = ebr_enter();
+    int ret = __ramcache_unlock_radix_page(fd, offset);
+    ebr_exit(ebr);
+    return ret;
+}
+
+//-----------------------------------------------
+int __ramcache_unlock_radix_page(int fd, off_t offset) {
+    radix_tree *tree = tree_of(fd);
+    if (tree != NULL) {
+        int lockret = radix_unlock_page(offset, tree);
+        if (lockret) {
+            printf("ERROR : Failed unlock fd=%d off=%ld error=%d\n", fd,
+                   offset, lockret);
+            perror("Unlock");
+            // exit(EXIT_FAILURE);
         }
+        if (trace(TRACE_UNLOCK)) {
+            printinfo(NVTRACE,
+                      GRN "|   Unlocked   | fd=%2d | off=%8ld |" RST, fd,
+                      page_base(offset));
+        }
+        return lockret;
     }
     return 0;
 }
@@ -243,19 +360,27 @@ ssize_t ramcache_pread(int fd, off_t offset, char *buf, size_t size) {
           free = page_free(offset);
 
     // first page
-    ssize_t ret = page_read(fd, offset, buf, min(free, size));
-    if (ret != free || free == size) {
-        return ret;
+    if (free >= size) {
+        return page_read(fd, offset, buf, size);
     }
 
     // stats
     ramcache.overlaps++;
 
-        
+    // Missing pages are read at once, the pages are then copied one by one
+    fill_range(fd, offset, size);
+
+    ssize_t ret = page_read(fd, offset, buf, free);
+    if (ret != free) {
+        return ret;
+    }
     size_t buf_offset = ret; // first is already written
     while(size-buf_offset > RAM_PAGE_SIZE){
       ret = page_read(fd, offset+buf_offset, buf+buf_offset, RAM_PAGE_SIZE);
       buf_offset += ret;
+      if (ret != RAM_PAGE_SIZE) {
+        return buf_offset;  // End of file
+      }
     }
 
     ret = page_read(fd, offset+buf_offset, buf+buf_offset, size-buf_offset);
@@ -288,53 +413,84 @@ ssize_t ramcache_pread(int fd, off_t offset, char *buf, size_t size) {
     */
 }
 
+//-----------------------------------------------
+// Caches the missing pages of [offset, offset + size). Each run of missing
+// pages is locked in order, then read by a single preadv (see read_pages()).
+//-----------------------------------------------
+void fill_range(int fd, off_t offset, size_t size) {
+    int ebr = ebr_enter();
+    radix_tree *tree = tree_of(fd);
+    off_t run = 0;
+    long nb = 0;
+    for (off_t base = page_base(offset); base < offset + (off_t)size;
+         base += RAM_PAGE_SIZE) {
+        int missing = radix_find(base, tree, NULL) == NULL;
+        if (missing) {
+            radix_lock_page(base, tree);
+            // Filled by another miss meanwhile ?
+            missing = radix_find(base, tree, NULL) == NULL;
+            if (!missing) {
+                radix_unlock_page(base, tree);
+            }
+        }
+        if (nb > 0 && (!missing || nb == max_read_pages())) {
+            fill_run(fd, run, nb);
+            nb = 0;
+        }
+        if (missing) {
+            if (nb++ == 0) {
+                run = base;
+            }
+        }
+    }
+    if (nb > 0) {
+        fill_run(fd, run, nb);
+    }
+    ebr_exit(ebr);
+}
+
+//-----------------------------------------------
+void fill_run(int fd, off_t base, long nb) {
+    radix_tree *tree = tree_of(fd);
+    ramcache.misses += nb;
+    read_pages(fd, base, nb);
+    for (long i = 0; i < nb; i++) {
+        radix_unlock_page(base + i * RAM_PAGE_SIZE, tree);
+    }
+    // A stream going on after this read is read ahead
+    ramcache.cache_table[fd]->ra_next = base + nb * RAM_PAGE_SIZE;
+}
+
 //-----------------------------------------------
 size_t page_read(int fd, off_t offset, char *buf, size_t size) {
   
-    page *p = get_page(fd, offset);  // To get the lock
-    while(pthread_mutex_trylock(&p->lock)){
-      p = get_page(fd, offset);  // Handles cache miss
+    page *p;
+    // The page can be evicted, and reused, until it is locked
+    for (;;) {
+        p = get_page(fd, offset);  // Handles cache miss
+        if (!page_trylock(p)) {
+            if (p->fd == fd && p->offset == page_base(offset)) {
+                break;
+            }
+            page_unlock(p);
+        }
     } //spinlock
 
     size_t read = 0;  
     off_t base = page_busy(offset), left = p->size - base;
     if (buf != NULL && left > 0) {
         read = min(size, left);
-        memcpy(buf, p->content + base, read);
+        memcpy(buf, page_content(p) + base, read);
     }
-    pthread_mutex_unlock(&p->lock);
+    page_unlock(p);
     return read;
 }
 
-//-----------------------------------------------
-void move_to_first_page(page *p){
-  page *next = p->next;
-  page *previous = p->previous;
-
-  if(p!=ramcache.last){
-    next->previous = previous;
-  }
-  if(p!=ramcache.first){
-    previous->next = next;
-  }
-  if(p==ramcache.last){
-    ramcache.last = previous;
-    ramcache.last->next = NULL;
-  }
-  
-  p->next = ramcache.first;
-  p->previous = NULL;
-
-  ramcache.first->previous = p;
-  
-  ramcache.first = p;
-  p->touched = 0;  
-}
-
-
 //-----------------------------------------------
 page *get_page(int fd, off_t offset) {  // Unaligned offset
+    int ebr = ebr_enter();
     page *p = __get_page(fd, offset);
+    ebr_exit(ebr);
     return p;
 }
 
@@ -346,25 +502,23 @@ page *__get_page(int fd, off_t offset) {  // Unaligned offset
 
     CHRONO_START(PERF_CACHEHIT);
     int dirty;
-    page *p =
-        radix_find(page_base(offset), ramcache.cache_table[fd]->tree, &dirty);
+    page *p = radix_find(page_base(offset), tree_of(fd), &dirty);
 
     if (p == NULL) {
         CHRONO_TRANSFER(PERF_CACHEHIT, PERF_CACHEMISS);
         ramcache_lock_radix_page(fd, offset);
-        p = cache_miss(fd, offset);
-        if (dirty > 0) {
-            CHRONO_TRANSFER(PERF_CACHEHIT, PERF_DIRTYMISS);
-            ramcache.dirty++;
-            p = dirty_miss(p, fd, offset);
+        // Another miss (or a readahead) may have filled it meanwhile
+        p = radix_find(page_base(offset), tree_of(fd), &dirty);
+        if (p == NULL) {
+            p = cache_miss(fd, offset);
         }
         ramcache_unlock_radix_page(fd, offset);
     } else {  // If it is a hit, the page is up to date
         ramcache.hits++;
+        policy_touch(p);
     }
     CHRONO_STOP(PERF_CACHEHIT);
 
-    p->touched=1; // Will be sent to the beginning on attempt to evict
     return p;
 }
 
@@ -376,8 +530,7 @@ page *dirty_miss(page *p, int fd, size_t offset) {
     }
     // pthread_mutex_lock(&nvcache_flush_mutex);
     int played = nvlog_play_log_on_page(fd, p);
-    if (played ==
-        radix_get_dirty_level(offset, ramcache.cache_table[fd]->tree)) {
+    if (played == radix_get_dirty_level(offset, tree_of(fd))) {
         // pthread_mutex_unlock(&nvcache_flush_mutex);
         return p;  // Give the updated page
     } else {
@@ -385,7 +538,7 @@ page *dirty_miss(page *p, int fd, size_t offset) {
         // pthread_mutex_unlock(&nvcache_flush_mutex);
         printinfo(
 		  NVTRACE, "CAS SPECIAL : offset=%ld played=%d dirty=%d", p->offset, played,
-            radix_get_dirty_level(offset, ramcache.cache_table[fd]->tree));
+            radix_get_dirty_level(offset, tree_of(fd)));
         return (get_page(fd, offset));
 	}
 }
@@ -414,54 +567,142 @@ page *cache_miss(int fd, off_t offset) {
 
 //-----------------------------------------------
 page *__cache_miss(int fd, off_t offset) {
-    char content[RAM_PAGE_SIZE];
-    ssize_t rd = musl_pread((int)fd, (void *)content, (size_t)RAM_PAGE_SIZE,
-                            (off_t)page_base(offset));
-
-    if (rd >= (ssize_t)0) {
-        page *p = add_page(page_base(offset), rd, rd == 0 ? NULL : content,
-                           ramcache.cache_table[fd]);
-        return p;
+    off_t base = page_base(offset);
+    radixcache *cache = ramcache.cache_table[fd];
+    long nb = readahead_lock(fd, base, readahead_pages(cache, base));
+    cache->ra_next = base + nb * RAM_PAGE_SIZE;
+
+    page *p = read_pages(fd, base, nb);
+    radix_tree *tree = tree_of(fd);
+    for (long i = 1; i < nb; i++) {
+        radix_unlock_page(base + i * RAM_PAGE_SIZE, tree);
+    }
+    return p;
+}
+
+//-----------------------------------------------
+// The victims of a read stay locked until they are filled: a few threads
+// reading at once must not be able to take the whole cache.
+//-----------------------------------------------
+long max_read_pages() {
+    return max(min(RAM_CACHE_SIZE / 64, (long)READ_PAGES_LIMIT), 1L);
+}
+
+//-----------------------------------------------
+// Caches nb pages from base at once, read straight into the pages that will
+// hold them. Their radix locks are held by the caller. Returns the first one.
+//-----------------------------------------------
+page *read_pages(int fd, off_t base, long nb) {
+    page *victims[nb];
+    struct iovec iov[nb];
+    for (long i = 0; i < nb; i++) {
+        victims[i] = evict_page(fd, base + i * RAM_PAGE_SIZE);
+        iov[i].iov_base = page_content(victims[i]);
+        iov[i].iov_len = RAM_PAGE_SIZE;
+    }
+    // Not intercepted by NVCache, like musl_pread()
+    ssize_t rd = preadv(fd, iov, nb, base);
+    if (rd < (ssize_t)0) {
+        printinfo(NVCRIT, "preadv fd=%d off=%ld returned %ld", fd, base, rd);
+        perror("preadv in cache miss");  // Might be because of a bad open
+    }
+
+    for (long i = nb - 1; i >= 0; i--) {
+        off_t done = i * RAM_PAGE_SIZE;
+        if (rd >= (ssize_t)0 && (i == 0 || done < rd)) {
+            fill_page(fd, victims[i], base + done,
+                      min(max(rd - done, (ssize_t)0), (ssize_t)RAM_PAGE_SIZE));
+        } else {
+            drop_page(victims[i]);  // Past the end of the file
+        }
+    }
+    return rd >= (ssize_t)0 ? victims[0] : NULL;
+}
+
+//-----------------------------------------------
+// Pages to read for a miss at base. Each file has one stream: a miss where
+// the previous read stopped (ra_next) doubles its window (up to READAHEAD_PAGES), any
+// other miss halves it and only reads its own page. These are hints, racing
+// misses at worst read too much or too little.
+//-----------------------------------------------
+long readahead_pages(radixcache *cache, off_t base) {
+    long max_window = min((long)READAHEAD_PAGES, max_read_pages());
+    long window = 1;
+    if (base == cache->ra_next) {
+        window = min(cache->ra_window, max_window);
+        cache->ra_window = min(2 * window, max_window);
     } else {
-        printinfo(NVCRIT, "pread_musl fd=%d off=%ld returned %ld", fd, offset,
-                  rd);
-        perror("pread_musl in cache miss");  // Might be because of a bad open
+        cache->ra_window = max(cache->ra_window / 2, 1L);
+    }
+    return max(window, 1L);
+}
+
+//-----------------------------------------------
+// Locks the pages to read after base, up to the first one that is cached or
+// whose radix lock is busy (a miss or the flusher is on it). They are read
+// locked: the flusher cannot write them back in between. Returns the number
+// of pages to read, base included.
+//-----------------------------------------------
+long readahead_lock(int fd, off_t base, long window) {
+    radix_tree *tree = tree_of(fd);
+    int dirty;
+    long nb = 1;
+    for (; nb < window; nb++) {
+        off_t offset = base + nb * RAM_PAGE_SIZE;
+        if (radix_find(offset, tree, &dirty) != NULL ||
+            radix_trylock_page(offset, tree)) {
+            break;
+        }
+        if (radix_find(offset, tree, &dirty) != NULL) {
+            radix_unlock_page(offset, tree);
+            break;
+        }
+    }
+    return nb;
+}
+
+//-----------------------------------------------
+// Caches an evicted page, read from the disk, with the log records that are
+// not on the disk yet. The caller holds the radix lock of the page: the
+// flusher cannot write and drop a record meanwhile.
+//-----------------------------------------------
+page *fill_page(int fd, page *p, off_t offset, ssize_t size) {
+    if (add_page(p, offset, size, ramcache.cache_table[fd]) == NULL) {
         return NULL;
     }
+    // Read once the page is in the tree: a writer that raises the level
+    // after this finds the page (see nvcache_pwrite()). The page stays
+    // locked until the log is played, not to be updated in between.
+    // The fence pairs with the increment of the level, a locked RMW.
+    atomic_thread_fence(memory_order_seq_cst);
+    if (ramcache_get_dirty_level(offset, fd) > 0) {
+        CHRONO_TRANSFER(PERF_CACHEMISS, PERF_DIRTYMISS);
+        ramcache.dirty++;
+        dirty_miss(p, fd, offset);
+    }
+    page_unlock(p);
+    return p;
 }
 
 //-----------------------------------------------
-page *add_page(off_t offset, ssize_t size, char *buf, radixcache *cache) {
-  page *mypage = __add_page(offset, size, buf, cache);
+page *add_page(page *newpage, off_t offset, ssize_t size,
+               radixcache *cache) {
+  page *mypage = __add_page(newpage, offset, size, cache);
   return mypage;
 }
 
 
 //-----------------------------------------------
-page *__add_page(off_t offset, ssize_t size, char *buf, radixcache *cache) {
+page *__add_page(page *newpage, off_t offset, ssize_t size,
+                 radixcache *cache) {
     // printf("Add_Page : fd=%d off=%ld size=%ld\n", cache->fd, offset,
     // size);
-    page *newpage = rm_last_page();
-    //The page is locked
-    
-    if (newpage == NULL) {
-        perror("rm_last_page returned NULL");
-        return NULL;
-    }
-
-    //memset(newpage->content, 0,
-    //     RAM_PAGE_SIZE);  // Erase garbage, could be removed ?
-    if (buf != NULL) {      // If NULL, the content is empty for the moment
-        memcpy(newpage->content, buf, RAM_PAGE_SIZE);
-    }
-    newpage->next = ramcache.first;
-    newpage->previous = NULL;
+    //The page is locked, out of the cache (see evict_page()), its content
+    //already read.
     newpage->fd = cache->fd;
     newpage->offset = offset;
     newpage->size = size;
-
-    ramcache.first->previous = newpage;
-    ramcache.first = newpage;
+    newpage->state = CLEAN;  // Until the log is played on it
 
     // Add into radix tree
     int test = radix_insert(newpage, offset, cache->tree);
@@ -474,54 +715,43 @@ page *__add_page(off_t offset, ssize_t size, char *buf, radixcache *cache) {
         printinfo(NVTRACE, GRN "Add page : Page (fd=%d, off=%ld, size=%ld)" RST,
                   cache->fd, offset, size);
     }
-    pthread_mutex_unlock(&newpage->lock);
-    return newpage;
+    return newpage;  // Still locked, see fill_page()
 }
 
 //-----------------------------------------------
-page *spinlock_last_page(){
-  page *last_page;
-  do {
-    last_page = ramcache.last;
-  } while(pthread_mutex_trylock(&last_page->lock));
-  return last_page;
+// Gives back an evicted page that is not needed, to be taken first
+//-----------------------------------------------
+void drop_page(page *p) {
+    p->fd = -1;
+    p->size = 0;
+    p->touched = 0;
+    page_unlock(p);
 }
 
 //-----------------------------------------------
-page *rm_last_page() {
-  pthread_mutex_lock(&lru_lock);
-  page *last_page;
+// Takes a page out of the cache to hold (fd, offset), see ram_policy.c
+//-----------------------------------------------
+page *evict_page(int fd, off_t offset) {
+    page *victim = policy_evict(fd, offset);
 
-  tryrm:
-  last_page = spinlock_last_page();
-  
-  if(last_page->touched)
-    {
-      //Update page position
-      move_to_first_page(last_page);
-      pthread_mutex_unlock(&last_page->lock);
-      goto tryrm;
-    }
-    
-    
-    last_page->previous->next = NULL;
-    ramcache.last = last_page->previous;
     // Clean the radix tree
-    if (last_page->fd != -1) {  // If the page is already in a radix tree
-        if (ramcache.cache_table[last_page->fd] != NULL) {
-	    radix_evict(last_page, ramcache.cache_table[last_page->fd]->tree);
+    if (victim->fd != -1) {  // If the page is already in a radix tree
+        int ebr = ebr_enter();
+        radix_tree *tree = tree_of(victim->fd);
+        if (tree != NULL) {
+            radix_evict(victim, tree);
         }
+        ebr_exit(ebr);
         if (trace(TRACE_EVICT)) {
             printinfo(NVTRACE,
                       GRN
-                      "Eviction : Page (fd=%d, off=%ld, size=%ld) evicted." RST,
-                      last_page->fd, last_page->offset, last_page->size);
+                      "Eviction : Page (fd=%d, off=%ld, size=%d) evicted." RST,
+                      victim->fd, victim->offset, victim->size);
         }
     }
-    //last_page->state = CLEAN;
-    pthread_mutex_unlock(&lru_lock);
-    pthread_mutex_unlock(&last_page->lock);
-    return last_page;
+    //victim->state = CLEAN;
+    // Still locked, until it is refilled (see fill_page())
+    return victim;
 }
 
 //-----------------------------------------------
@@ -581,29 +811,89 @@ size_t page_write(int fd, off_t offset, const char *buf, size_t size) {
     size_t ret = 0;
     int dirty = 0;
 
-    page *p =
-        radix_find(page_base(offset), ramcache.cache_table[fd]->tree, &dirty);
+    int ebr = ebr_enter();
+    page *p = radix_find(page_base(offset), tree_of(fd), &dirty);
+    // The page can be evicted, and reused, until it is locked
+    for (; p != NULL; p = radix_find(page_base(offset), tree_of(fd), &dirty)) {
+        if (!page_trylock(p)) {
+            if (p->fd == fd && p->offset == page_base(offset)) {
+                break;
+            }
+            page_unlock(p);
+        }
+    }
+    ebr_exit(ebr);
 
     if (p != NULL) {
-        while(pthread_mutex_trylock(&p->lock)){
-	    page *p =
-	      radix_find(page_base(offset), ramcache.cache_table[fd]->tree, &dirty);
-	    
-	    if(p==NULL) return size;
-	}
+        policy_touch(p);
         p->state = DIRTY;
         ret = min(page_free(offset), size);
         off_t busy = page_busy(offset);
-        memcpy(p->content + busy, buf, ret);
+        memcpy(page_content(p) + busy, buf, ret);
         // Update page size
         p->size = max(p->size, busy + ret);
         assert(p->size <= RAM_PAGE_SIZE);
-	pthread_mutex_unlock(&p->lock);
+	page_unlock(p);
 	return ret;
     }
     return size;
 }
 
+//-----------------------------------------------
+// A write is committed in the log and not in its pages yet: the flusher
+// takes no copy of these pages meanwhile (see count_write() @nvlog.c)
+//-----------------------------------------------
+void ramcache_write_begin(int fd, off_t offset, size_t size) {
+    add_writers(fd, offset, size, 1);
+}
+
+//-----------------------------------------------
+void ramcache_write_end(int fd, off_t offset, size_t size) {
+    add_writers(fd, offset, size, -1);
+}
+
+//-----------------------------------------------
+void add_writers(int fd, off_t offset, size_t size, int n) {
+    int nbpages = 1 + ((size - 1 + page_busy(offset)) / RAM_PAGE_SIZE);
+
+    offset = page_base(offset);
+    int ebr = ebr_enter();
+    radix_tree *tree = tree_of(fd);
+    for (int i = 0; tree != NULL && i < nbpages; i++) {
+        radix_add_writers(offset + (i * RAM_PAGE_SIZE), tree, n);
+    }
+    ebr_exit(ebr);
+}
+
+//-----------------------------------------------
+// Copies the page of fd at base into buf, for the flusher, which holds its
+// radix lock: it is not filled or played meanwhile. Only a dirty page is
+// copied (written since its last copy, with records in the log), then it is
+// clean until its next write. Returns its size, or -1 if it is not copied:
+// not cached, clean, busy, or a write may still be between its record and
+// the page. A copy has every write committed before the call.
+//-----------------------------------------------
+ssize_t ramcache_page_image(int fd, off_t base, char *buf) {
+    ssize_t size = -1;
+    int level;
+    int ebr = ebr_enter();
+    radix_tree *tree = tree_of(fd);
+    page *p = tree != NULL ? radix_find(base, tree, &level) : NULL;
+    if (p != NULL && level > 0 && !page_trylock(p)) {
+        // The writers of the committed records have counted themselves
+        // before their commit, and are done with the page once they leave
+        if (p->fd == fd && p->offset == base && p->state == DIRTY &&
+            radix_get_writers(base, tree) == 0) {
+            p->state = CLEAN;
+            size = p->size;
+            memcpy(buf, page_content(p), size);
+        }
+        page_unlock(p);
+    }
+    ebr_exit(ebr);
+    return size;
+}
+
 //-----------------------------------------------
 int ramcache_exists(int fd) { return ramcache.cache_table[fd] != NULL; }
 
@@ -612,6 +902,8 @@ radixcache *ramcache_newradix(int fd) {
     radixcache *rcache = malloc(sizeof(radixcache));
     rcache->fd = fd;
     rcache->tree = radix_newtree(RAM_PAGE_SIZE);
+    rcache->ra_next = 0;
+    rcache->ra_window = 1;
     ramcache.cache_table[fd] = rcache;
 
     return rcache;
@@ -622,6 +914,8 @@ void ramcache_file_clean(int fd) {
     radixcache *cache = ramcache.cache_table[fd];
     if (cache != NULL) {
         ramcache.cache_table[fd] = NULL;
+        // Freed once no thread can still be walking the tree
+        ebr_retire(cache, release_radixcache);
         if (trace(TRACE_CLEAN)) {
             printinfo(NVTRACE, GRN "RAM cache: file (fd=%d) cleaned" RST, fd);
         }
@@ -630,15 +924,23 @@ void ramcache_file_clean(int fd) {
     }
 }
 
+//-----------------------------------------------
+void release_radixcache(void *cache) {
+    radix_free_tree(((radixcache *)cache)->tree);
+    free(cache);
+}
+
 //-----------------------------------------------
 void ramcache_lower_dirty_level(key k, int size, int fd) {
     int nbpages = 1 + ((size - 1 + page_busy(k)) / RAM_PAGE_SIZE);
 
     k = page_base(k);
-    for (int i = 0; i < nbpages; i++) {
-        radix_decrease_dirty_level(k + (i * RAM_PAGE_SIZE),
-                                   ramcache.cache_table[fd]->tree);
+    int ebr = ebr_enter();
+    radix_tree *tree = tree_of(fd);
+    for (int i = 0; tree != NULL && i < nbpages; i++) {
+        radix_decrease_dirty_level(k + (i * RAM_PAGE_SIZE), tree);
     }
+    ebr_exit(ebr);
 }
 
 //-----------------------------------------------
@@ -646,37 +948,21 @@ void ramcache_greater_dirty_level(key k, int size, int fd) {
     int nbpages = 1 + ((size - 1 + page_busy(k)) / RAM_PAGE_SIZE);
 
     k = page_base(k);
-    for (int i = 0; i < nbpages; i++) {
-        radix_increase_dirty_level(k + (i * RAM_PAGE_SIZE),
-                                   ramcache.cache_table[fd]->tree);
+    int ebr = ebr_enter();
+    radix_tree *tree = tree_of(fd);
+    for (int i = 0; tree != NULL && i < nbpages; i++) {
+        radix_increase_dirty_level(k + (i * RAM_PAGE_SIZE), tree);
     }
+    ebr_exit(ebr);
 }
 
 //-----------------------------------------------
 int ramcache_get_dirty_level(key k, int fd) {
-    return radix_get_dirty_level(k, ramcache.cache_table[fd]->tree);
-}
-
-//-----------------------------------------------
-int get_cache_length_fw() {
-    int i = 1;
-    page *current_page = ramcache.first;
-    while (current_page->next != NULL) {
-        i++;
-        current_page = current_page->next;
-    }
-    return i;
-}
-
-//-----------------------------------------------
-int get_cache_length_bw() {
-    int i = 1;
-    page *current_page = ramcache.last;
-    while (current_page->previous != NULL) {
-        i++;
-        current_page = current_page->previous;
-    }
-    return i;
+    int ebr = ebr_enter();
+    radix_tree *tree = tree_of(fd);
+    int level = tree != NULL ? radix_get_dirty_level(k, tree) : -1;
+    ebr_exit(ebr);
+    return level;
 }
 
 //-----------------------------------------------
@@ -718,12 +1004,10 @@ void ramcache_print() {
               "\t  Overlaps   | %8lu\n"
               "\tDirty misses | %8lu\n"
               "\t--------------------------------\n"
-              "\t--------------------------------\n"
-              "\tCache length (FW) : %d\n"
-              "\tCache length (BW) : %d\n" RST,
+              "\t--------------------------------" RST,
               ramcache.hits, ramcache.misses, ramcache.hits + ramcache.misses,
-              ramcache.overlaps, ramcache.dirty, get_cache_length_fw(),
-              get_cache_length_bw());
+              ramcache.overlaps, ramcache.dirty);
+    policy_print();
 }
 
 //-----------------------------------------------
@@ -732,8 +1016,7 @@ void gdb_print_dirty(ssize_t min_off, ssize_t max_off, int fd) {
     printinfo(NVTRACE, "|  Offset  |  Dirty level  |");
     printinfo(NVTRACE, "+----------+---------------+");
     for (ssize_t k = min_off % RAM_PAGE_SIZE; k < max_off; k += RAM_PAGE_SIZE) {
-        int dirty_level =
-            radix_get_dirty_level(k, ramcache.cache_table[fd]->tree);
+        int dirty_level = ramcache_get_dirty_level(k, fd);
         if (dirty_level > 0) {
             printinfo(NVTRACE, "|%10ld|%15d|", k, dirty_level);
         }
@@ -14,6 +14,11 @@ extern "C" {
 extern long __ram_cache_size;
   
 ramcache_t ramcache;
+
+// Payload of a page, at the same index in the slab as its descriptor
+static inline char *page_content(page *p) {
+    return ramcache.payloads + (p - ramcache.page_table) * RAM_PAGE_SIZE;
+}
   
 void ramcache_init();
 void ramcache_flush();
@@ -29,6 +34,9 @@ radixcache *ramcache_newradix(int fd);
 int ramcache_exists(int fd);
 ssize_t ramcache_pread(int fd, off_t offset, char *buf, size_t size);
 ssize_t ramcache_pwrite(int fd, off_t offset, const char *buf, size_t size);
+void ramcache_write_begin(int fd, off_t offset, size_t size);
+void ramcache_write_end(int fd, off_t offset, size_t size);
+ssize_t ramcache_page_image(int fd, off_t base, char *buf);
 void ramcache_file_clean(int fd);
 
 #define max(a, b)               \
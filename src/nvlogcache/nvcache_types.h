@@ -1,5 +1,6 @@
 #pragma once
 #include <sys/types.h>
+#include <stdint.h>
 #include <stdatomic.h>
 #include "nvcache_config.h"
 
@@ -14,8 +15,8 @@ typedef off_t key;  // Here, the key is an offset in a file
 struct node_s;
 struct leaf_s;
 typedef union child_u {
-    struct node_s *subnode;
-    struct leaf_s *leafnode;
+    struct node_s *_Atomic subnode;
+    struct leaf_s *_Atomic leafnode;
 } child;
 
 typedef struct node_s {
@@ -27,9 +28,10 @@ typedef struct node_s {
 typedef struct leaf_s {
     struct node_s *parent;
     int level;
-    void *pages[RADIX_MAXCHILDREN];
-    int dirty[RADIX_MAXCHILDREN];
-    pthread_mutex_t lock[RADIX_MAXCHILDREN];
+    void *_Atomic pages[RADIX_MAXCHILDREN];
+    atomic_int dirty[RADIX_MAXCHILDREN];
+    atomic_int writers[RADIX_MAXCHILDREN];  // See ramcache_write_begin()
+    atomic_uint_least64_t lock[RADIX_MAXCHILDREN];  // See radix-tree.c
 } leaf;
 
 typedef struct radix_tree_s {
@@ -40,6 +42,8 @@ typedef struct radix_tree_s {
 typedef struct radixcache_s {
     int fd;
     radix_tree *tree;
+    off_t ra_next;   // Where the sequential stream of the file should miss next
+    long ra_window;  // Pages it will read then (see readahead_pages())
 } radixcache;
 
 
@@ -54,21 +58,45 @@ typedef struct {
     char opened;
 } file_t;
 
+// Header of a record of the NVlog, one cache line. Records are packed in the
+// segments: the header is followed by the payload, padded to a cache line.
 typedef struct {
-    int fd;  // TODO : change for file_id       // Index in the file_table
+    atomic_size_t lsn;      // Position of the record in its segment (monotonic)
+                            // written last: the header is valid once it matches
+    atomic_size_t seq;      // Global order of the record (timestamp)
     size_t offset;          // Unaligned
-    size_t size;            // The n firts bytes are the change
-    size_t waiting;         // Index of the log you're waiting to be committed
-    atomic_char committed;  // Is the entry ready to be written on disk ?
+    size_t waiting;         // Position of the first record of the write,
+    int waiting_segment;    // and its segment
+    int fd;  // TODO : change for file_id       // Index in the file_table
+    uint32_t size;          // The n firts bytes are the change
+    uint32_t length;        // Bytes taken in the segment, header included
+    uint32_t checksum;      // Of the header, see record_checksum()
+    uint32_t crc;           // Of the header and the payload, see record_crc()
+    uint32_t records;       // Records of the write
+    atomic_char committed;  // Volatile: the write is finished, it can be
+                            // written on disk. The recovery checks crc.
     char already_written;   // If the file has been closed already, entry has
                             // been flushed.
-    char content[LOGENTRY_SIZE];
+    char content[] __attribute__((aligned(64)));
 } log_entry_t;
 
+#define NVLOG_MAX_SEGMENTS 64
+
+// Persistent part of a log segment, one cache line each
+typedef struct {
+    volatile size_t tail;  // Position of the first record to flush (monotonic)
+    char padding[64 - sizeof(size_t)];
+} nvlog_segment_t;
+
 typedef struct {
     file_t file_table[MAX_FILES];
-    volatile size_t nvlog_tail;
-    log_entry_t entries[];
+    volatile size_t nvlog_state;  // NVLOG_CLEAN once flushed or recovered
+    size_t nb_segments;
+    size_t segment_size;  // Bytes per segment, a multiple of a cache line
+    nvlog_segment_t segments[NVLOG_MAX_SEGMENTS];
+    // Segment s owns bytes [s*size, (s+1)*size), position p of the segment is
+    // at p % size.
+    char records[] __attribute__((aligned(64)));
 } nvlog_t;
 
 
@@ -79,25 +107,34 @@ enum page_state_e { CLEAN, DIRTY, LAST_CHANCE };
 typedef enum page_state_e page_state;
 
 
+// Page descriptors are packed two per cache line, their payloads are in a
+// separate slab (see page_content()): lookups and the eviction hand never
+// touch the payloads. A descriptor is all zeros until the page is first used.
 typedef struct page_s {
-    int fd;
     off_t offset;
-    ssize_t size;
-    char content[RAM_PAGE_SIZE];
-    struct page_s *previous;
-    struct page_s *next;
+    int fd;
+    int size;
     page_state state;
-    pthread_mutex_t lock; // Sync between read/writes and eviction
-    char touched; // For LRU
-    leaf *radix_parent; // Pointer to corresponding leaf in the radix tree
-} page;
+    atomic_char lock;  // Sync between read/writes and eviction
+    char touched;      // Reference bit, see ram_policy.c
+    char hot;          // 2Q queue of the page
+} __attribute__((aligned(32))) page;
 
-typedef struct ramcache_s {
+// Pages are only ever tried: readers and writers retry, the eviction hand
+// skips a busy page. Returns 0 once locked, like pthread_mutex_trylock().
+static inline int page_trylock(page *p) {
+    return atomic_exchange_explicit(&p->lock, 1, memory_order_acquire);
+}
 
-    page *first, *last;
+static inline void page_unlock(page *p) {
+    atomic_store_explicit(&p->lock, 0, memory_order_release);
+}
+
+typedef struct ramcache_s {
     unsigned long int hits, misses, overlaps, writes, dirty;
     double w_latency;
     radixcache *cache_table[MAX_FILES];  // One radix root per file
     page* page_table;  // One page table for all files
+    char *payloads;    // Page-aligned, RAM_CACHE_SIZE * RAM_PAGE_SIZE bytes
 } ramcache_t;
 
@@ -16,7 +16,7 @@
 
 #ifdef NVINFO_ALL_STATS
 extern ramcache_t ramcache;
-extern atomic_size_t available_blocks, added_entries, flushed_entries;
+extern atomic_size_t added_entries, flushed_entries;
 #endif
 
 struct timespec tp;
@@ -77,7 +77,7 @@ void printinfo(uint8_t level, const char *format, ...) {
 #endif //STATS_ONLY
 #ifdef NVINFO_ALL_STATS
     if (level & NVTRACE){
-      printf("H %d M %d Dm %d A %ld F %ld W %ld\n", ramcache.hits, ramcache.misses, ramcache.dirty, atomic_load(&added_entries), atomic_load(&flushed_entries), LOG_SIZE-atomic_load(&available_blocks));
+      printf("H %d M %d Dm %d A %ld F %ld W %ld\n", ramcache.hits, ramcache.misses, ramcache.dirty, atomic_load(&added_entries), atomic_load(&flushed_entries), nvlog_used());
     }
 #endif
     
@@ -2,16 +2,24 @@
 #include "nvlog.h"
 #include <assert.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
 #include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
+#include "crc32c.h"
+#include "ntcopy.h"
 #include "nvcache_ram.h"
+#include "log_index.h"
 #include "nvinfo.h"
+#include "pmem.h"
+#include "uring.h"
+#include "waitq.h"
 
 #define TRACE_ADD 0x1
 #define TRACE_DISK_WRITE 0x2
@@ -22,7 +30,11 @@ static int tracemask = 0; //TRACE_FLUSH;//TRACE_DISK_WRITE | TRACE_PLAY_LOG | TR
 
 pthread_mutex_t nvcache_flush_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-#define INCR_IN_LOG(index) (index) = (index + 1) % LOG_SIZE
+#define NB_SEGMENTS (nvlog->nb_segments)
+#define SEGMENT_SIZE (nvlog->segment_size)
+// Bytes taken by a record of n bytes of payload
+#define RECORD_LENGTH(n) \
+    (sizeof(log_entry_t) + (((n) + FLUSH_ALIGN - 1) & ~(FLUSH_ALIGN - 1)))
 //-----------------------------------------------
 //             NOT EXPORTED
 //-----------------------------------------------
@@ -31,34 +43,206 @@ static int trace(int bit);
 #else
 #define trace(x) 0
 #endif
-static int mypmem_fd;
+
+// Volatile part of a log segment. Writers only contend on the segment of
+// the CPU they run on.
+typedef struct {
+    atomic_size_t head;   // Reserved bytes (monotonic)
+    atomic_size_t tail;   // Freed bytes (monotonic)
+    atomic_size_t added;  // Reserved records
+    atomic_size_t freed;  // Freed records
+} __attribute__((aligned(64))) segment_t;
+
+// A growable list of log entries, see collect_entries()
+typedef struct {
+    log_entry_t **entries;
+    size_t count, capacity;
+} entry_list_t;
+
 static nvlog_t *nvlog;
+static segment_t segments[NVLOG_MAX_SEGMENTS];
+static log_entry_t **batch_writes;  // Entries of the batch to write on disk
+static log_entry_t **batch_absorbed;  // And those that are overwritten
+static atomic_size_t absorbed_entries;
 static pthread_t write_thread;
 static struct timespec time_sleep;
 static atomic_int wthread = 1;
-static atomic_size_t nvlog_head = 0;
-static int files_to_fsync[1024] = {0};
+static waitq_t flusher_wq = WAITQ_INITIALIZER;  // The write thread, idle
+static waitq_t room_wq = WAITQ_INITIALIZER;     // Writers, log full
+static atomic_int room_wanted;                  // Writers parked on room_wq
+static pthread_mutex_t large_write_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// A small write posted for group commit, see group_commit()
+#define COMBINE_SLOTS 64
+#define COMBINE_FREE 0
+#define COMBINE_CLAIMED 1  // Being posted
+#define COMBINE_POSTED 2
+#define COMBINE_DONE 3     // Logged and committed
+typedef struct {
+    atomic_int state;
+    int fd;
+    size_t offset;
+    const char *content;
+    size_t count;
+} __attribute__((aligned(64))) combine_slot_t;
+
+static combine_slot_t combine_slots[COMBINE_SLOTS];
+static atomic_int combining = 0;  // A writer is the combiner
+static waitq_t combine_wq = WAITQ_INITIALIZER;  // Posters, not logged yet
+static waitq_t slot_wq = WAITQ_INITIALIZER;     // Writers, no free slot
+static atomic_size_t combined_runs, combined_writes;  // Fences, writes
+
+// A record a batch had to leave behind (not committed, or a page locked): the
+// later records of the file that overlap it are left too
+typedef struct {
+    int fd;
+    size_t start, end;
+} skipped_t;
+#define MAX_SKIPPED 64
+
+// With WRITE_BACK_PAGES, a page cached in RAM with records in a batch (see
+// page_write_back())
+typedef struct {
+    int fd;
+    size_t base;
+    log_entry_t *image;  // Written as a whole, else NULL: record by record
+} batch_page_t;
+#define MAX_PAGE_IMAGES 256  // Per batch, appended to batch_writes
+#define IMAGE_STRIDE (sizeof(log_entry_t) + RAM_PAGE_SIZE)
+
+static char *page_images;  // MAX_PAGE_IMAGES images, as fake records
+static entry_list_t batch_reclaimed;  // Records not reached, in the images
+static atomic_size_t paged_entries, paged_images;
+
+// Write plan of flush_to_disk(): extents to write, each made of iovcnt pieces
+// of the log starting at iov[iov]
+typedef struct {
+    int fd;
+    int iovcnt;
+    size_t offset, size;
+    size_t iov;
+} extent_t;
+
+typedef struct {
+    extent_t *extents;
+    size_t nb_extents, max_extents;
+    struct iovec *iov;
+    size_t nb_iov, max_iov;
+    const int *fd_map;  // Recovery: file of each logged fd, else NULL
+} write_plan_t;
+
+// A flusher of the pool writes back the files of a batch that hash to it.
+// Flusher 0 is run by the thread that collected the batch (under
+// nvcache_flush_mutex), the others by their own thread.
+typedef struct {
+    pthread_t thread;
+    log_entry_t **writes;  // Its share of the current batch
+    size_t nb_writes;
+    write_plan_t plan;
+    uring_t ring;  // With FLUSH_ENGINE_URING
+    int uring_ready;
+} flusher_t;
+
+static flusher_t *flushers;
+static int nb_flushers = 1;
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+static size_t pool_batch = 0;  // Batches handed to the pool
+static int pool_pending = 0;   // Flushers still writing the current batch
+static int pool_running = 0;
+
+// A recovery thread: scans segments id, id + nb_recoverers..., then writes
+// back the files that hash to it
+typedef struct {
+    int id;
+    entry_list_t list;  // Recoverable entries of its segments
+    entry_list_t chained;  // Records of writes that may not be complete
+    long ignored;
+    flusher_t f;        // Its share of them (by file) and their write plan
+} recoverer_t;
+
+static recoverer_t *recoverers;
+static int nb_recoverers;
+static int *recovered_fd;  // Index is the logged fd, value the reopened one
 
 //-----------------------------------------------
-static int recover_entry(log_entry_t *entry);
+static int reopened(log_entry_t *entry);
+static int intact(log_entry_t *entry, size_t pos);
+static int first_written(log_entry_t *entry);
+static int compare_write(const void *a, const void *b);
+static void check_writes(entry_list_t *chained, entry_list_t *list,
+                         long *ignored);
 static void recover_nvlog(void);
+static void recover_parallel(void *(*work)(void *));
+static void *recover_scan(void *arg);
+static void *recover_write_back(void *arg);
+static int valid_geometry(void);
+static void init_segments(void);
 static void *disk_write_loop();
 static int nvlog_empty();
-static void reset_nvram();
-static void *memcpy_ntstore(void *_dest, void *_src, size_t n);
-static void *memcpy_ntstore32(void *_dst, void *_src, size_t n);
-static void memcpy_ntstore_nova(void *to, void *from);
+static int flush_wanted(void *unused);
+static int log_has_room(void *length);
+static size_t nvlog_records(void);
+static size_t nvlog_timestamp(void);
+static int my_segment(void);
+static log_entry_t *record_at(int s, size_t pos);
+static uint32_t record_checksum(log_entry_t *entry, size_t pos);
+static uint32_t record_crc(log_entry_t *entry, size_t pos, const char *payload);
+static int record_valid(log_entry_t *entry, size_t pos);
+static log_entry_t *wait_record(int s, size_t pos);
+static size_t group_length(size_t count, size_t *bytes);
+static int nvlog_reserve_record(int s, size_t length, size_t *pos,
+                                size_t *padding, size_t *seq);
+static int reserve_room(int seg, size_t length, size_t *pos, size_t *seq);
+static void log_payload(int seg, size_t pos, const char *content);
+static void count_write(int fd, size_t offset, size_t size);
+static void group_commit(int fd, size_t offset, const char *content,
+                         size_t count);
+static void combine(unsigned first);
+static int combine_ready(void *slot);
+static int slot_free(void *unused);
+static void publish_record(log_entry_t *entry, size_t pos, size_t seq,
+                           int fd, size_t offset, size_t size, size_t length,
+                           int waiting_segment, size_t waiting,
+                           size_t records);
+static log_entry_t *next_in_order(size_t *cursor, int *segment);
+static int compare_seq(const void *a, const void *b);
+static void entry_list_add(entry_list_t *list, log_entry_t *entry);
+static void collect_entries(int fd, page *rampage, entry_list_t *list);
+static void collect_indexed(int s, size_t pos, void *list);
 static void flush_with_clwb(volatile char *content, size_t count);
-static size_t flush_to_disk(log_entry_t *log_entry);
+static int compare_extent(const void *a, const void *b);
+static void init_flushers(void);
+static void start_flushers(pthread_attr_t *tattr);
+static void stop_flushers(void);
+static void *flusher_loop(void *arg);
+static void write_back(log_entry_t **entries, size_t count);
+static size_t flush_to_disk(flusher_t *f, log_entry_t **entries, size_t count);
+static size_t plan_extent(write_plan_t *plan, log_entry_t **run, size_t count,
+                          size_t end);
+static extent_t *plan_new_extent(write_plan_t *plan, int fd, size_t offset);
+static void write_plan_sync(write_plan_t *plan);
+static void write_plan_uring(flusher_t *f);
+static void uring_queue_extent(flusher_t *f, extent_t *e, int link);
 static void unsafe_log_flush(log_entry_t *log_entry);
+static int is_log_batchable(log_entry_t *log_entry);
+static int obsolete(log_entry_t *log_entry);
+static int overlaps_skipped(skipped_t *skipped, int nb, log_entry_t *entry);
+static int compare_batch_page(const void *a, const void *b);
+static batch_page_t *batch_page(batch_page_t *pages, size_t nb, int fd,
+                                size_t base);
+static size_t page_write_back(size_t *nb_writes, size_t *nb_absorbed,
+                              size_t *cursor, skipped_t *skipped,
+                              int nb_skipped);
+static int reached_by_batch(log_entry_t *log_entry, size_t *cursor);
 static int __flush_batch();
 static void flush_batch();
 static int page_concerned(log_entry_t *log, page *ram, size_t *orig,
                           size_t *dest, size_t *size);
 static int __nvlog_play_log_on_page(int fd, page *rampage);
-static int log_to_socache(log_entry_t *log_entry);
 static void mark_written(log_entry_t *log_entry);
-static void free_log_entry(log_entry_t *log_entry);
+static size_t free_records(int s, size_t end, size_t *records);
 //-----------------------------------------------
 extern int is_writeonly(int fd);
 extern int is_ramcached(int fd);
@@ -66,15 +250,135 @@ extern int is_ramcached(int fd);
 #define clwb(val) flush_with_clwb((volatile char *)&val, sizeof(val))
 //-----------------------------------------------
 
-int recover_entry(log_entry_t *entry){
-  if(!entry->fd>0) return 0;
-  if(entry->already_written) return 0;
-  if(!entry->committed) return 0;
-  if(entry->waiting == INVALID_STATE) return 0;
-  if(!nvlog->entries[entry->waiting].committed) return 0;
-  flush_to_disk(entry);  // do not fsync after pwrite
-  return 1;
-  
+//-----------------------------------------------
+int reopened(log_entry_t *entry){
+  return entry->fd>0 && entry->fd<MAX_FILES && recovered_fd[entry->fd]>0;
+}
+
+//-----------------------------------------------
+// Torn by the crash (or damaged on the media) if it does not match its crc
+//-----------------------------------------------
+int intact(log_entry_t *entry, size_t pos){
+  int ws = entry->waiting_segment;
+  if(ws<0 || ws>=nvlog->nb_segments) return 0;
+  return entry->crc == record_crc(entry, pos, entry->content);
+}
+
+//-----------------------------------------------
+// The flusher only writes the records of a write once it is committed, so
+// once all of them are persistent, and frees none of them before the first
+// one is written (see free_records()). Then the write is complete.
+//-----------------------------------------------
+int first_written(log_entry_t *entry){
+  int ws = entry->waiting_segment;
+  size_t waiting = entry->waiting;
+  if(waiting < nvlog->segments[ws].tail) return 1;
+  log_entry_t *first = record_at(ws, waiting);
+  return record_valid(first, waiting) && first->already_written;
+}
+
+//-----------------------------------------------
+// Groups the records of a write
+//-----------------------------------------------
+int compare_write(const void *a, const void *b){
+  log_entry_t *x = *(log_entry_t **)a, *y = *(log_entry_t **)b;
+  if(x->waiting_segment != y->waiting_segment){
+    return x->waiting_segment < y->waiting_segment ? -1 : 1;
+  }
+  return x->waiting < y->waiting ? -1 : x->waiting > y->waiting;
+}
+
+//-----------------------------------------------
+// A write none of whose records is written yet is complete if all its records
+// match their crc: they are then added to the list, the written ones aside.
+//-----------------------------------------------
+void check_writes(entry_list_t *chained, entry_list_t *list, long *ignored){
+  qsort(chained->entries, chained->count, sizeof(log_entry_t *),
+	compare_write);
+  for(size_t i=0, end; i<chained->count; i=end){
+    for(end=i+1; end<chained->count &&
+	  !compare_write(&chained->entries[i], &chained->entries[end]); end++);
+    int complete = end-i == chained->entries[i]->records;
+    for(size_t j=i; j<end; j++){
+      log_entry_t *entry = chained->entries[j];
+      if(entry->already_written || !reopened(entry)){
+	continue;
+      }
+      if(complete){
+	entry_list_add(list, entry);
+      }
+      else{
+	++*ignored;
+      }
+    }
+  }
+}
+
+//-----------------------------------------------
+// Runs work on each recoverer, each on its own thread
+//-----------------------------------------------
+void recover_parallel(void *(*work)(void *)){
+  pthread_t threads[nb_recoverers];
+  for(int i=1; i<nb_recoverers; i++){
+    pthread_create(&threads[i], NULL, work, &recoverers[i]);
+  }
+  work(&recoverers[0]);
+  for(int i=1; i<nb_recoverers; i++){
+    pthread_join(threads[i], NULL);
+  }
+}
+
+//-----------------------------------------------
+// Walks one lap of each segment from its tail. The head was not persisted:
+// the records are found back with their header, a hole (record reserved but
+// never written) is skipped one cache line at a time. The segments are
+// independent, but a write may have records in several of them: the records
+// of a write that may not be complete are checked together afterwards.
+//-----------------------------------------------
+void *recover_scan(void *arg){
+  recoverer_t *r = arg;
+  for(size_t s=r->id; s<NB_SEGMENTS; s+=nb_recoverers){
+    size_t tail = nvlog->segments[s].tail;
+    for(size_t pos=tail; pos<tail+SEGMENT_SIZE; ){
+      log_entry_t *entry = record_at(s, pos);
+      if(!record_valid(entry, pos)){
+	pos += FLUSH_ALIGN;
+	continue;
+      }
+      if(entry->fd==NVLOG_PADDING){
+	// Nothing to write
+      }
+      else if(entry->records>1 && !first_written(entry)){
+	if(intact(entry, pos)){
+	  entry_list_add(&r->chained, entry);
+	}
+	else if(!entry->already_written){
+	  ++r->ignored;
+	}
+      }
+      else if(!entry->already_written){
+	if(reopened(entry) && intact(entry, pos)){
+	  entry_list_add(&r->list, entry);
+	}
+	else{
+	  ++r->ignored;
+	}
+      }
+      pos += entry->length;
+    }
+  }
+  return NULL;
+}
+
+//-----------------------------------------------
+// Like a batch (see flush_to_disk()): the bytes overwritten in the log are
+// written once, the contiguous ones with a single pwritev, and each file is
+// synced once. nb_writes becomes the number of entries written.
+//-----------------------------------------------
+void *recover_write_back(void *arg){
+  flusher_t *f = &((recoverer_t *)arg)->f;
+  f->nb_writes = flush_to_disk(f, f->writes, f->nb_writes);
+  return NULL;
 }
 
 //-----------------------------------------------
@@ -82,12 +386,23 @@ void recover_nvlog(){
   printinfo(NVINFO, RED "PMEM IS NOT EMPTY" RST);
   printinfo(NVINFO, RED "Starting recovery procedure...\n" RST);
 
+  // The log may have been written with another geometry
+  size_t nb_segments = nvlog->nb_segments;
+  size_t segment_size = nvlog->segment_size;
+  if(!valid_geometry()){
+    printinfo(NVCRIT, "Unknown log geometry (%lu segments of %lu bytes), "
+	      "nothing recovered", nb_segments, segment_size);
+    nvlog->nvlog_state = NVLOG_CLEAN;
+    clwb(nvlog->nvlog_state);
+    PFENCE();
+    return;
+  }
+
   // Index is old fd. Value is new fd.
   int new_fd[MAX_FILES] = {0};
   long int recovered = 0;
   long int ignored = 0;
-  size_t current_tail = nvlog->nvlog_tail;
-  
+
   for(int i=0; i<MAX_FILES; i++){
     file_t file = nvlog->file_table[i];
     if(file.opened){
@@ -104,35 +419,74 @@ void recover_nvlog(){
   printinfo(NVINFO, "");
   printinfo(NVINFO, BLU"Flushing PMEM to disk..."RST);
 
-  
-  for(long int i=0; i<LOG_SIZE; i++){
-    log_entry_t entry = nvlog->entries[current_tail];
-    entry.fd = new_fd[entry.fd];
-    int rec = recover_entry(&entry);
-    if(rec==1){
-      ++recovered;
-    } else {
-      ++ignored;
-    } 
-    INCR_IN_LOG(current_tail);
+  // FLUSH_THREADS threads split the segments to find the records, then the
+  // files to write them back
+  nb_recoverers = max(1, min(FLUSH_THREADS, MAX_FILES));
+  recoverers = calloc(nb_recoverers, sizeof(recoverer_t));
+  recovered_fd = new_fd;
+  for(int i=0; i<nb_recoverers; i++){
+    recoverers[i].id = i;
+    recoverers[i].f.plan.fd_map = new_fd;
+  }
+  recover_parallel(recover_scan);
+
+  entry_list_t chained = {NULL, 0, 0};
+  for(int i=0; i<nb_recoverers; i++){
+    entry_list_t *list = &recoverers[i].chained;
+    for(size_t j=0; j<list->count; j++){
+      entry_list_add(&chained, list->entries[j]);
+    }
+    free(list->entries);
+  }
+  check_writes(&chained, &recoverers[0].list, &ignored);
+  free(chained.entries);
+
+  for(int i=0; i<nb_recoverers; i++){
+    entry_list_t *list = &recoverers[i].list;
+    for(size_t j=0; j<list->count; j++){
+      recoverers[list->entries[j]->fd % nb_recoverers].f.nb_writes++;
+    }
+    ignored += recoverers[i].ignored;
+  }
+  for(int i=0; i<nb_recoverers; i++){
+    flusher_t *f = &recoverers[i].f;
+    f->writes = malloc(f->nb_writes * sizeof(log_entry_t *));
+    f->nb_writes = 0;
+  }
+  for(int i=0; i<nb_recoverers; i++){
+    entry_list_t *list = &recoverers[i].list;
+    for(size_t j=0; j<list->count; j++){
+      flusher_t *f = &recoverers[list->entries[j]->fd % nb_recoverers].f;
+      f->writes[f->nb_writes++] = list->entries[j];
+    }
   }
+  recover_parallel(recover_write_back);
+
+  for(int i=0; i<nb_recoverers; i++){
+    recoverer_t *r = &recoverers[i];
+    recovered += r->f.nb_writes;
+    free(r->list.entries);
+    free(r->f.writes);
+    free(r->f.plan.extents);
+    free(r->f.plan.iov);
+  }
+  free(recoverers);
 
-  nvlog->nvlog_tail = INVALID_STATE;
-  clwb(nvlog->nvlog_tail);
+  nvlog->nvlog_state = NVLOG_CLEAN;
+  clwb(nvlog->nvlog_state);
   PFENCE();
-  
+
   printinfo(NVINFO, BLU"-- PMEM flushed. --"RST);
-  printinfo(NVINFO, "Statistics on %d entries :");
-  printinfo(NVINFO, "-----> Flushed : %ld entries", recovered);
-  printinfo(NVINFO, "-----> Ignored : %ld entries", ignored);
+  printinfo(NVINFO, "Statistics on %lu records :", recovered + ignored);
+  printinfo(NVINFO, "-----> Flushed : %ld records", recovered);
+  printinfo(NVINFO, "-----> Ignored : %ld records", ignored);
   printinfo(NVINFO, "");
   printinfo(NVINFO, "Continuing with a clean log.");
 
   for(int i=0; i<MAX_FILES; i++){
     int fd = new_fd[i];
     if(fd>0){
-      musl_fsync(fd);
-      musl_close(fd);
+      musl_close(fd);  // Synced by the write-back
     }
     nvlog->file_table[i].opened=0;
     clwb(nvlog->file_table[i]);
@@ -143,35 +497,46 @@ void recover_nvlog(){
 
 //-----------------------------------------------
 void nvlog_init() {
-    available_blocks = LOG_SIZE;
-
     added_entries = 0;
     flushed_entries = 0;
-    
-    mypmem_fd = musl_open(PMEM_PATH, O_RDWR, 0);
-    if (mypmem_fd == -1) {
-        perror("Pmem");
-    }
 
-    nvlog = mmap((void *)0x7f625ef55000, sizeof(nvlog_t)+LOG_SIZE*sizeof(log_entry_t),
-                 PROT_READ | PROT_WRITE, (MAP_SHARED_VALIDATE | MAP_SYNC), mypmem_fd, 0);
-    if (nvlog == MAP_FAILED) {
-        perror("Nvlog mmap");
+    int fresh;
+    nvlog = pmem_map(sizeof(nvlog_t) + LOG_SIZE, &fresh);
+    if (fresh) {
+        // Nothing was ever logged here
+        nvlog->nvlog_state = NVLOG_CLEAN;
     }
 
+    crc32c_init();
+    printinfo(NVINFO, MAG "NVlog : CRC32C by %s" RST,
+              crc32c_hardware() ? "SSE4.2" : "table");
+    ntcopy_init(NT_COPY);
+    printinfo(NVINFO, MAG "NVlog : %s copies" RST,
+              ntcopy_name(ntcopy_selected()));
+
     // Trying to recover the data from NVRAM, if needed
 
     if(ENABLE_RECOVER){
-      if (nvlog->nvlog_tail != INVALID_STATE) {
+      if (nvlog->nvlog_state != NVLOG_CLEAN) {
 	recover_nvlog();
       }
     }
-    
-    reset_nvram();
+
+    init_segments();
+    log_index_init();
     PFENCE();
     // NVRAM ready to be used
-    nvlog->nvlog_tail = 0;
-    clwb(nvlog->nvlog_tail);
+    nvlog->nvlog_state = NVLOG_ACTIVE;
+    clwb(nvlog->nvlog_state);
+    PFENCE();
+
+    batch_writes =
+        malloc((MAX_BATCH_SIZE + MAX_PAGE_IMAGES) * sizeof(log_entry_t *));
+    batch_absorbed = malloc(MAX_BATCH_SIZE * sizeof(log_entry_t *));
+    if (WRITE_BACK == WRITE_BACK_PAGES) {
+        page_images = aligned_alloc(64, MAX_PAGE_IMAGES * IMAGE_STRIDE);
+    }
+    init_flushers();
 
     time_sleep.tv_sec = 1;
     time_sleep.tv_nsec = 0;
@@ -189,6 +554,7 @@ void nvlog_init() {
     pthread_attr_setschedparam(&tattr,&param);
     pthread_create(&write_thread, &tattr, disk_write_loop, NULL);
     pthread_setaffinity_np(write_thread, sizeof(cpus), &cpus);
+    start_flushers(&tattr);
     }
     else {
     printinfo(NVINFO, MAG
@@ -198,52 +564,316 @@ void nvlog_init() {
 }
 
 //-----------------------------------------------
-int nvlog_reserve_block(size_t *index) {
-    size_t available_local = available_blocks;
-    if (available_local <= 1 ||
-        atomic_compare_exchange_strong(&available_blocks, &available_local,
-                                       available_local - 1) == 0) {
+int valid_geometry() {
+    return nvlog->nb_segments > 0 && nvlog->nb_segments <= NVLOG_MAX_SEGMENTS &&
+           nvlog->segment_size % FLUSH_ALIGN == 0 &&
+           nvlog->nb_segments * nvlog->segment_size <= LOG_SIZE;
+}
+
+//-----------------------------------------------
+// The log is split in one segment per CPU (or LOG_SEGMENTS), each with its
+// own head and tail, so that concurrent writers do not serialize on a single
+// counter. The global order is given by log_entry_t.seq.
+//
+// Positions restart one lap after anything the previous run may have written:
+// its records can no more match their position, and the log does not need to
+// be cleared.
+//-----------------------------------------------
+void init_segments() {
+    size_t start = 0;
+    if (valid_geometry()) {
+        for (int s = 0; s < NB_SEGMENTS; s++) {
+            start = max(start, nvlog->segments[s].tail);
+        }
+        start += SEGMENT_SIZE;
+    }
+
+    long nb = LOG_SEGMENTS;
+    if (nb <= 0) {
+        nb = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    // Each segment must hold at least two of the largest records
+    nb = max(1L, min(nb, (long)NVLOG_MAX_SEGMENTS));
+    nb = min(nb, LOG_SIZE / (2 * (long)RECORD_LENGTH(LOGENTRY_SIZE)));
+    if (nb < 1) {
+        printinfo(NVCRIT, "NVlog too small: %ld bytes for records of %ld bytes",
+                  LOG_SIZE, (long)RECORD_LENGTH(LOGENTRY_SIZE));
+        exit(EXIT_FAILURE);
+    }
+
+    nvlog->nb_segments = nb;
+    nvlog->segment_size = (LOG_SIZE / nb) & ~(FLUSH_ALIGN - 1);
+    start += SEGMENT_SIZE;
+    for (int s = 0; s < NVLOG_MAX_SEGMENTS; s++) {
+        nvlog->segments[s].tail = start;
+        segments[s].head = start;
+        segments[s].tail = start;
+        segments[s].added = 0;
+        segments[s].freed = 0;
+    }
+    flush_with_clwb((volatile char *)&nvlog->nb_segments,
+                    sizeof(size_t) * 2 + sizeof(nvlog->segments));
+
+    printinfo(NVINFO, MAG "NVlog : %lu segments of %lu bytes" RST,
+              NB_SEGMENTS, SEGMENT_SIZE);
+}
+
+//-----------------------------------------------
+log_entry_t *record_at(int s, size_t pos) {
+    return (log_entry_t *)&nvlog->records[s * SEGMENT_SIZE + pos % SEGMENT_SIZE];
+}
+
+//-----------------------------------------------
+int my_segment() {
+    int cpu = sched_getcpu();
+    return (cpu < 0 ? 0 : cpu) % NB_SEGMENTS;
+}
+
+//-----------------------------------------------
+// Invariant TSC, synchronized between cores: gives the order of the writes
+// without sharing a cache line between writers.
+//-----------------------------------------------
+size_t nvlog_timestamp() {
+    unsigned int lo, hi, aux;
+    __asm__ volatile("rdtscp" : "=a"(lo), "=d"(hi), "=c"(aux));
+    return ((size_t)hi << 32) | lo;
+}
+
+//-----------------------------------------------
+// Only guards against stale bytes (old payloads, records of a previous lap)
+// being taken for a header, the payload is not covered.
+//-----------------------------------------------
+uint32_t record_checksum(log_entry_t *entry, size_t pos) {
+    size_t fields[] = {pos, entry->seq, entry->offset, entry->size,
+                       entry->length, entry->waiting,
+                       (size_t)(uint32_t)entry->fd << 32 |
+                           (uint32_t)entry->waiting_segment};
+    size_t h = 0xcbf29ce484222325UL;
+    for (int i = 0; i < sizeof(fields) / sizeof(size_t); i++) {
+        h = (h ^ fields[i]) * 0x100000001b3UL;
+        h ^= h >> 29;
+    }
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+//-----------------------------------------------
+// What the recovery needs of a record: its header (but the volatile flags)
+// and its payload, read from the buffer of the writer when it is logged. A
+// record torn by a crash, or damaged on the media, does not match.
+//-----------------------------------------------
+uint32_t record_crc(log_entry_t *entry, size_t pos, const char *payload) {
+    size_t fields[] = {pos, entry->seq, entry->offset, entry->waiting,
+                       (size_t)entry->size << 32 | entry->length,
+                       (size_t)(uint32_t)entry->fd << 32 |
+                           (uint32_t)entry->waiting_segment,
+                       entry->records};
+    uint32_t crc = crc32c(0, fields, sizeof(fields));
+    return crc32c(crc, payload, entry->size);
+}
+
+//-----------------------------------------------
+int record_valid(log_entry_t *entry, size_t pos) {
+    if (atomic_load_explicit(&entry->lsn, memory_order_acquire) != pos) {
+        return 0;
+    }
+    return entry->length >= sizeof(log_entry_t) &&
+           entry->length % FLUSH_ALIGN == 0 &&
+           entry->length <= SEGMENT_SIZE - pos % SEGMENT_SIZE &&
+           entry->size <= entry->length - sizeof(log_entry_t) &&
+           entry->checksum == record_checksum(entry, pos);
+}
+
+//-----------------------------------------------
+// Between the reservation of a record and the publication of its header, the
+// length is unknown and the rest of the segment cannot be walked. Writers
+// publish the header right after reserving.
+// Returns NULL if the record has been freed (and maybe reused) meanwhile.
+//-----------------------------------------------
+log_entry_t *wait_record(int s, size_t pos) {
+    log_entry_t *entry = record_at(s, pos);
+    while (!record_valid(entry, pos)) {
+        if (pos < segments[s].tail) {
+            return NULL;
+        }
+        sched_yield();
+    }
+    return entry;
+}
+
+//-----------------------------------------------
+// The records of a write are reserved at once, one after the other in a
+// segment, as long as they take at most half of it: a writer never waits for
+// room with a write half logged, its first record not committed would keep
+// the segment from being freed. Returns the length of the records of the
+// first *bytes of the count bytes.
+//-----------------------------------------------
+size_t group_length(size_t count, size_t *bytes) {
+    size_t length = 0;
+    *bytes = 0;
+    while (*bytes < count) {
+        size_t n = min(count - *bytes, (size_t)LOGENTRY_SIZE);
+        if (length && length + RECORD_LENGTH(n) > SEGMENT_SIZE / 2) {
+            break;
+        }
+        length += RECORD_LENGTH(n);
+        *bytes += n;
+    }
+    return length;
+}
+
+//-----------------------------------------------
+// Records never wrap: when the end of the segment is too short, it is
+// reserved too and filled with a padding record.
+// The timestamp is taken before the reservation: every record before pos in
+// the segment is then older than any write that starts once this one is
+// done, and the flusher (see next_in_order()) cannot write them out of order.
+//-----------------------------------------------
+int nvlog_reserve_record(int s, size_t length, size_t *pos, size_t *padding,
+                         size_t *seq) {
+    segment_t *seg = &segments[s];
+    *seq = nvlog_timestamp();
+    size_t head = seg->head;
+    size_t room = SEGMENT_SIZE - head % SEGMENT_SIZE;
+    size_t pad = length > room ? room : 0;
+    if (head + pad + length - seg->tail > SEGMENT_SIZE ||
+        atomic_compare_exchange_strong(&seg->head, &head,
+                                       head + pad + length) == 0) {
       return 0;
     }
-    
-    *index = atomic_fetch_add(&nvlog_head, 1) % LOG_SIZE;
-    ++added_entries;
+
+    *padding = pad;
+    *pos = head + pad;
     return 1;
 }
 
 //-----------------------------------------------
-void nvlog_copy_to_log(int fd, log_entry_t *log_entry, size_t to_offset,
-                       const char *content, size_t n) {
-  assert(fd!=0);
-    log_entry->fd = fd;  // TODO: use inodes ?
-    log_entry->offset = to_offset;
-    log_entry->size = n;
-    log_entry->already_written = 0;
-    if(n>256){
-      memcpy_ntstore(log_entry->content, content, n);
+// Makes the header visible to the flusher and the readers, not persistent:
+// the line is written back once, with the commit (see nvlog_add_entry()).
+//-----------------------------------------------
+void publish_record(log_entry_t *entry, size_t pos, size_t seq, int fd,
+                    size_t offset, size_t size, size_t length,
+                    int waiting_segment, size_t waiting, size_t records) {
+    entry->seq = seq;
+    entry->fd = fd;
+    entry->offset = offset;
+    entry->size = size;
+    entry->length = length;
+    entry->waiting_segment = waiting_segment;
+    entry->waiting = waiting;
+    entry->records = records;
+    entry->crc = 0;
+    entry->committed = 0;
+    entry->already_written = 0;
+    entry->checksum = record_checksum(entry, pos);
+    // Same cache line: persisted with or after the fields above
+    atomic_store_explicit(&entry->lsn, pos, memory_order_release);
+}
+
+//-----------------------------------------------
+// Ordered by the caller, with the other records of the write
+//-----------------------------------------------
+void nvlog_copy_to_log(log_entry_t *log_entry, const char *content,
+                       size_t n) {
+    ntcopy(log_entry->content, content, n);
+}
+
+//-----------------------------------------------
+// Reserves length bytes in seg, or the next segment with room, and returns
+// the segment. The padding before *pos, if any, is published.
+//-----------------------------------------------
+int reserve_room(int seg, size_t length, size_t *pos, size_t *seq) {
+    size_t padding;
+    unsigned misses = 0;
+
+    if (!FLUSH_THREAD &&
+        nvlog_used() + length > NB_SEGMENTS * SEGMENT_SIZE) {
+        perror("Impasse: log is full, there is no thread to empty it");
+        exit(-666);
     }
-    else{
-      memcpy(log_entry->content, content, n);
-      flush_with_clwb(log_entry->content, n);
+    while (!nvlog_reserve_record(seg, length, pos, &padding, seq)) {
+        seg = (seg + 1) % NB_SEGMENTS;  // Full or contended, move on
+        if (++misses % NB_SEGMENTS == 0) {
+            // Went round: wait for the flusher to free some room
+            atomic_fetch_add(&room_wanted, 1);
+            waitq_notify(&flusher_wq);
+            waitq_wait(&room_wq, log_has_room, &length);
+            atomic_fetch_sub(&room_wanted, 1);
+        }
     }
-      
-    
-    clwb(log_entry->fd);
-    clwb(log_entry->offset);
-    clwb(log_entry->size);
-    clwb(log_entry->already_written);
-    PFENCE();
-    assert(log_entry->fd!=0);
-    //flush_with_clwb(log_entry->content, n);
+
+    if (padding) {
+        // Never flushed, freed with the record that follows
+        log_entry_t *pad = record_at(seg, *pos - padding);
+        publish_record(pad, *pos - padding, *seq, NVLOG_PADDING, 0, 0,
+                       padding, seg, *pos - padding, 1);
+        pad->committed = 1;
+        pad->already_written = 1;
+        clwb(pad->committed);
+        atomic_fetch_add(&segments[seg].added, 1);
+    }
+    return seg;
 }
 
+//-----------------------------------------------
+// With WRITE_BACK_PAGES, a write of a file cached in RAM is counted on its
+// pages from just before its commit until they have it, nvcache_pwrite()
+// ends it: the flusher takes no copy of them meanwhile (see
+// ramcache_page_image()). Not before, a writer waiting for room would hold
+// them off.
+//-----------------------------------------------
+void count_write(int fd, size_t offset, size_t size) {
+#ifndef USE_LINUXCACHE
+    if (WRITE_BACK == WRITE_BACK_PAGES && !is_writeonly(fd)) {
+        ramcache_write_begin(fd, offset, size);
+    }
+#endif
+}
+
+//-----------------------------------------------
+// The payload of a published record, and its crc. Not ordered: the caller
+// fences once for all the records it logs.
+//-----------------------------------------------
+void log_payload(int seg, size_t pos, const char *content) {
+    log_entry_t *log_entry = record_at(seg, pos);
+    nvlog_copy_to_log(log_entry, content, log_entry->size);
+    log_entry->crc = record_crc(log_entry, pos, content);
+    clwb(*log_entry);
+
+#ifndef USE_LINUXCACHE
+    // Write only files are not cached in RAM
+    if (!is_writeonly(log_entry->fd)) {
+        // Indexed before the page is marked dirty: a dirty miss that
+        // sees the level finds the record
+        log_index_add(log_entry->fd, log_entry->offset, log_entry->size, seg,
+                      pos);
+        ramcache_greater_dirty_level(log_entry->offset, log_entry->size,
+                                     log_entry->fd);
+    }
+#endif
+}
+
+//-----------------------------------------------
+// The header of a record is its first cache line, the payload follows. Each
+// line is written back once: the payloads are streamed, and each header once
+// its crc is set. No store has to be persistent before another: the recovery
+// only takes a write whose records all match their crc (see check_writes()),
+// so a write costs a single fence. The write is then committed, committed
+// being only seen by the flusher and the readers: everything they can see
+// is persistent.
+//
+// Larger writes are logged in several groups, one at a time: only one of
+// them can keep a segment from being freed, the others get the room it waits
+// for.
 //-----------------------------------------------
 void nvlog_add_entry(int fd, size_t offset, const char *content, size_t count) {
     if (!count) return;
 
-    size_t my_index;
+    size_t my_pos;
     size_t start_off = 0;
     log_entry_t *first_log = NULL;  // First log in case of multiple-log writes
+    int first_seg = 0;
+    size_t first_pos = 0;
+    int seg = my_segment();
 
     if (trace(TRACE_ADD)) {
         printinfo(NVTRACE,
@@ -251,54 +881,213 @@ void nvlog_add_entry(int fd, size_t offset, const char *content, size_t count) {
                   offset, count);
     }
 
-    // Waiting to reserve a free block
+    if (GROUP_COMMIT && count <= LOGENTRY_SIZE) {
+        group_commit(fd, offset, content, count);
+        return;
+    }
+
+    size_t bytes;
+    group_length(count, &bytes);
+    int large = bytes < count;
+    if (large) {
+        pthread_mutex_lock(&large_write_mutex);
+    }
+    size_t records = (count + LOGENTRY_SIZE - 1) / LOGENTRY_SIZE;
+
     do {
-#ifndef FLUSH_THREAD
-        if (available_blocks == 0) {
-            perror("Impasse: log is full, there is no thread to empty it");
-            exit(-666);
+        size_t length = group_length(count, &bytes);
+        size_t seq;
+        seg = reserve_room(seg, length, &my_pos, &seq);
+
+        if (!first_log) {
+            first_seg = seg;
+            first_pos = my_pos;
+            first_log = record_at(seg, my_pos);
         }
-#endif
-
-        if (!nvlog_reserve_block(&my_index)) {
-            continue;
+        // Published right away: the flusher cannot go past a record while its
+        // header is not written.
+        size_t group = 0;
+        for (size_t done = 0, pos = my_pos; done < bytes; group++) {
+            size_t n = min(bytes - done, (size_t)LOGENTRY_SIZE);
+            publish_record(record_at(seg, pos), pos, seq, fd,
+                           offset + start_off + done, n, RECORD_LENGTH(n),
+                           first_seg, first_pos, records);
+            done += n;
+            pos += RECORD_LENGTH(n);
+        }
+        atomic_fetch_add(&segments[seg].added, group);
+
+        size_t group_pos = my_pos;
+        for (size_t done = 0; done < bytes; ) {
+            size_t n = min(bytes - done, (size_t)LOGENTRY_SIZE);
+            log_payload(seg, my_pos, content + start_off);
+            my_pos += RECORD_LENGTH(n);
+            done += n;
+            start_off += n;
         }
+        count -= bytes;
+
+        PFENCE();
+        // The first record is committed last: the flusher only writes the
+        // others once it is
+        for (size_t pos = group_pos; pos < my_pos; ) {
+            log_entry_t *log_entry = record_at(seg, pos);
+            if (log_entry != first_log) {
+                atomic_store_explicit(&log_entry->committed, 1,
+                                      memory_order_release);
+            }
+            pos += log_entry->length;
+        }
+    } while (count);  // For >4096 logs
 
-        log_entry_t *log_entry = &nvlog->entries[my_index];
-        size_t n = count < LOGENTRY_SIZE ? count : LOGENTRY_SIZE;
-        nvlog_copy_to_log(fd, log_entry, offset + start_off,
-                          content + start_off, n);
+    count_write(fd, offset, start_off);  // The whole write
+    atomic_store_explicit(&first_log->committed, 1, memory_order_release);
+    if (large) {
+        pthread_mutex_unlock(&large_write_mutex);
+    }
+
+    if (waitq_waiters(&flusher_wq) && flush_wanted(NULL)) {
+        waitq_notify(&flusher_wq);
+    }
+}
+
+//----------------------------------------------
+//        Group commit
+//----------------------------------------------
+
+//-----------------------------------------------
+// Flat combining of the small writes (NVCACHE_GROUP_COMMIT=1). A writer
+// posts its write in a slot, then either finds it logged by another writer,
+// or takes the combiner role: the combiner logs every write posted so far as
+// a run of records in a single reservation, with a single fence, and
+// releases their writers. The records stay those of one-record writes, the
+// flusher and the recovery see no difference. The other writers park on
+// combine_wq until their write is logged or the role is free again, and on
+// slot_wq while no slot is free.
+//
+// libc code cannot rely on thread-local storage: a writer claims a free
+// slot, starting from one derived from its thread (see ebr_enter()).
+//-----------------------------------------------
+void group_commit(int fd, size_t offset, const char *content, size_t count) {
+    unsigned slot = ((uintptr_t)pthread_self() >> 6) * 2654435761u %
+                    COMBINE_SLOTS;
+    for (unsigned tries = 1;; tries++) {
+        int free = COMBINE_FREE;
+        if (atomic_compare_exchange_strong(&combine_slots[slot].state, &free,
+                                           COMBINE_CLAIMED)) {
+            break;
+        }
+        slot = (slot + 1) % COMBINE_SLOTS;
+        if (tries % COMBINE_SLOTS == 0) {
+            waitq_wait(&slot_wq, slot_free, NULL);  // More writers than slots
+        }
+    }
 
-        if (first_log) {
-            // Pre-committing the logs that are not the first
-            //(Will not be persisted on disk while the first is not committed
-            log_entry->waiting = first_log->waiting;
-            clwb(log_entry->waiting);
-            atomic_store_explicit(&log_entry->committed, 1,
-                                  memory_order_release);
-            clwb(log_entry->committed);
+    combine_slot_t *mine = &combine_slots[slot];
+    mine->fd = fd;
+    mine->offset = offset;
+    mine->content = content;
+    mine->count = count;
+    atomic_store_explicit(&mine->state, COMBINE_POSTED, memory_order_release);
+
+    while (atomic_load_explicit(&mine->state, memory_order_acquire) !=
+           COMBINE_DONE) {
+        if (!atomic_exchange(&combining, 1)) {
+            combine(slot);
+            atomic_store(&combining, 0);
+            waitq_notify(&combine_wq);  // For the writes posted meanwhile
         } else {
-            first_log = log_entry;
-            log_entry->waiting = my_index;
-            clwb(log_entry->waiting);
+            waitq_wait(&combine_wq, combine_ready, mine);
         }
+    }
+    atomic_store_explicit(&mine->state, COMBINE_FREE, memory_order_release);
+    waitq_notify(&slot_wq);
+}
 
-#ifndef USE_LINUXCACHE
-        // Write only files are not cached in RAM
-        if (!is_writeonly(fd)) {
-            ramcache_greater_dirty_level(offset + start_off, n, fd);
+//-----------------------------------------------
+// The write of the slot is logged, or nobody is logging the posted writes
+//-----------------------------------------------
+int combine_ready(void *slot) {
+    combine_slot_t *posted = slot;
+    return atomic_load_explicit(&posted->state, memory_order_acquire) ==
+               COMBINE_DONE ||
+           !atomic_load(&combining);
+}
+
+//-----------------------------------------------
+int slot_free(void *unused) {
+    for (unsigned i = 0; i < COMBINE_SLOTS; i++) {
+        if (atomic_load(&combine_slots[i].state) == COMBINE_FREE) {
+            return 1;
         }
-#endif
+    }
+    return 0;
+}
 
-        start_off += n;
-        count -= n;
-    } while (count);  // For >4096 logs
+//-----------------------------------------------
+// Logs the posted writes, starting from the combiner's own one, as long as
+// they take at most half of a segment (see group_length()).
+// The records get consecutive timestamps: the readers and the recovery
+// order the writes of a run like the flusher, by their position.
+//-----------------------------------------------
+void combine(unsigned first) {
+    unsigned taken[COMBINE_SLOTS];
+    int nb = 0;
+    size_t length = 0;
+    for (unsigned i = 0; i < COMBINE_SLOTS; i++) {
+        unsigned slot = (first + i) % COMBINE_SLOTS;
+        combine_slot_t *posted = &combine_slots[slot];
+        if (atomic_load_explicit(&posted->state, memory_order_acquire) !=
+            COMBINE_POSTED) {
+            continue;
+        }
+        size_t n = RECORD_LENGTH(posted->count);
+        if (length && length + n > SEGMENT_SIZE / 2) {
+            break;
+        }
+        length += n;
+        taken[nb++] = slot;
+    }
+    if (!nb) {
+        return;  // Logged by the previous combiner
+    }
 
+    size_t pos, seq;
+    int seg = reserve_room(my_segment(), length, &pos, &seq);
+    size_t run = pos;
+    for (int i = 0; i < nb; i++) {
+        combine_slot_t *posted = &combine_slots[taken[i]];
+        publish_record(record_at(seg, pos), pos, seq + i, posted->fd,
+                       posted->offset, posted->count,
+                       RECORD_LENGTH(posted->count), seg, pos, 1);
+        pos += RECORD_LENGTH(posted->count);
+    }
+    atomic_fetch_add(&segments[seg].added, nb);
+
+    pos = run;
+    for (int i = 0; i < nb; i++) {
+        combine_slot_t *posted = &combine_slots[taken[i]];
+        log_payload(seg, pos, posted->content);
+        pos += RECORD_LENGTH(posted->count);
+    }
     PFENCE();
-    // Commit the first log
-    atomic_store_explicit(&first_log->committed, 1, memory_order_release);
-    clwb(first_log->committed);
-    PFENCE();
+
+    pos = run;
+    for (int i = 0; i < nb; i++) {
+        log_entry_t *log_entry = record_at(seg, pos);
+        count_write(log_entry->fd, log_entry->offset, log_entry->size);
+        atomic_store_explicit(&log_entry->committed, 1, memory_order_release);
+        atomic_store_explicit(&combine_slots[taken[i]].state, COMBINE_DONE,
+                              memory_order_release);
+        pos += log_entry->length;
+    }
+    waitq_notify(&combine_wq);
+    atomic_fetch_add(&combined_runs, 1);
+    atomic_fetch_add(&combined_writes, nb);
+
+    if (waitq_waiters(&flusher_wq) && flush_wanted(NULL)) {
+        waitq_notify(&flusher_wq);
+    }
 }
 
 //----------------------------------------------
@@ -322,7 +1111,7 @@ void nvlog_reset_file_table(int fd){
   nvlog->file_table[fd].opened=0;
   clwb(nvlog->file_table[fd].opened);
   PFENCE();
- 
+
 }
 
 //----------------------------------------------
@@ -364,6 +1153,61 @@ int page_concerned(log_entry_t *log, page *ram, size_t *orig, size_t *dest,
     return 1;
 }
 
+//-----------------------------------------------
+// Entries are only ordered inside a segment: lists gathered across segments
+// are sorted with this before being applied.
+//-----------------------------------------------
+int compare_seq(const void *a, const void *b) {
+    size_t sa = (*(log_entry_t **)a)->seq, sb = (*(log_entry_t **)b)->seq;
+    return sa < sb ? -1 : sa > sb;
+}
+
+//-----------------------------------------------
+void entry_list_add(entry_list_t *list, log_entry_t *entry) {
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? 2 * list->capacity : 64;
+        list->entries =
+            realloc(list->entries, list->capacity * sizeof(log_entry_t *));
+    }
+    list->entries[list->count++] = entry;
+}
+
+//-----------------------------------------------
+// Gathers the live entries of fd, in global order. If rampage is not NULL,
+// only the entries indexed on the page are kept (the caller checks that they
+// are committed): the log is not walked.
+//-----------------------------------------------
+void collect_entries(int fd, page *rampage, entry_list_t *list) {
+    if (rampage != NULL) {
+        log_index_foreach(fd, rampage->offset, collect_indexed, list);
+        qsort(list->entries, list->count, sizeof(log_entry_t *), compare_seq);
+        return;
+    }
+    for (int s = 0; s < NB_SEGMENTS; s++) {
+        size_t head = segments[s].head;
+        for (size_t pos = segments[s].tail; pos < head;) {
+            log_entry_t *logentry = wait_record(s, pos);
+            if (logentry == NULL) {
+                pos = max(pos, (size_t)segments[s].tail);  // Flushed
+                continue;
+            }
+            pos += logentry->length;
+            if (logentry->fd == fd) {
+                entry_list_add(list, logentry);
+            }
+        }
+    }
+    qsort(list->entries, list->count, sizeof(log_entry_t *), compare_seq);
+}
+
+//-----------------------------------------------
+// The records of a page locked by the caller cannot be freed meanwhile: the
+// flusher needs the lock of their pages (see __flush_batch()).
+//-----------------------------------------------
+void collect_indexed(int s, size_t pos, void *list) {
+    entry_list_add(list, record_at(s, pos));
+}
+
 //-----------------------------------------------
 // nvcache_flush_mutex is used to serialize the following procedures:
 // void flush_batch() @nvlog.c
@@ -394,34 +1238,31 @@ int __nvlog_play_log_on_page(int fd, page *rampage) {
                   dirty_level);
     }
 
-    size_t c_disk_tail = nvlog->nvlog_tail;
-    size_t c_whead = nvlog_head % LOG_SIZE;
+    entry_list_t list = {NULL, 0, 0};
     size_t ret = 0;
 
-    while (c_disk_tail != c_whead) {
-        log_entry_t *logentry = nvlog->entries + c_disk_tail;
+    collect_entries(fd, rampage, &list);
+    for (size_t i = 0; i < list.count; i++) {
+        log_entry_t *logentry = list.entries[i];
         size_t origin, destination, size;
         if (page_concerned(logentry, rampage, &origin, &destination, &size)) {
             if (trace(TRACE_PLAY_LOG)) {
                 printinfo(NVTRACE,
                           MAG
                           "NVlog : ---> Playing logentry LOG(off=%ld, "
-                          "size=%ld) (logoff= %ld, ramoff= %ld, size= %ld)" RST,
+                          "size=%ld) (logoff= %ld, ramoff= %ld, size= %ld) "
+                          "seq=%lu" RST,
                           logentry->offset, logentry->size, origin, destination,
-                          size);
-                printinfo(
-                    NVTRACE,
-                    RED
-                    "NVlog play => c_disk_tail = %8ld | c_whead = %8ld\n" RST,
-                    c_disk_tail, c_whead);
+                          size, logentry->seq);
             }
-            memcpy(rampage->content + destination, logentry->content + origin,
+            memcpy(page_content(rampage) + destination, logentry->content + origin,
                    size);
             rampage->size = max(rampage->size, destination + size);
+            rampage->state = DIRTY;  // Not on the disk yet
             ++ret;
         }
-        INCR_IN_LOG(c_disk_tail);
     }
+    free(list.entries);
     if (trace(TRACE_PLAY_LOG)) {
         printinfo(NVTRACE,
                   MAG "=== Logs played : %d ===\n=== Dirty Level : %d ===", ret,
@@ -433,14 +1274,27 @@ int __nvlog_play_log_on_page(int fd, page *rampage) {
 //-----------------------------------------------
 void nvlog_final_flush(void) {
     wthread = 0;  // Stops the next iteration of write thread
+    waitq_notify(&flusher_wq);
     tracemask = 0;
-#ifdef FLUSH_THREAD
-    pthread_join(write_thread, NULL);
-#endif
+    if (FLUSH_THREAD) {  // Runtime setting, always defined
+        pthread_join(write_thread, NULL);
+    }
+    stop_flushers();
 
+    for (int s = 0; s < NB_SEGMENTS; s++) {
+        added_entries += segments[s].added;
+    }
     printinfo(NVINFO, BLU "\t -- Final flush --" RST);
-    printinfo(NVINFO, BLD "\tAdded: %lu\n\tFlushed: %lu" RST, added_entries,
-              flushed_entries);
+    printinfo(NVINFO, BLD "\tAdded: %lu\n\tFlushed: %lu\n\tAbsorbed: %lu" RST,
+              added_entries, flushed_entries, absorbed_entries);
+    if (GROUP_COMMIT) {
+        printinfo(NVINFO, BLD "\tGrouped: %lu writes, %lu fences" RST,
+                  combined_writes, combined_runs);
+    }
+    if (WRITE_BACK == WRITE_BACK_PAGES) {
+        printinfo(NVINFO, BLD "\tPaged: %lu records, %lu pages" RST,
+                  paged_entries, paged_images);
+    }
 
 #ifndef FAST_FLUSH
     size_t final_flush = 0;
@@ -454,42 +1308,74 @@ void nvlog_final_flush(void) {
 #endif
 
     //Set clean exit flag
-    nvlog->nvlog_tail = INVALID_STATE;
-    clwb(nvlog->nvlog_tail);
+    nvlog->nvlog_state = NVLOG_CLEAN;
+    clwb(nvlog->nvlog_state);
     PFENCE();
 }
 
 //-----------------------------------------------
-void reset_nvram() {
-    for (int i = LOG_SIZE-1; i >= 0; --i) {
-        nvlog->entries[i].fd = -1;
-        //nvlog->entries[i].offset = 0;
-        //nvlog->entries[i].size = 0;
-        nvlog->entries[i].waiting = INVALID_STATE;
-        nvlog->entries[i].committed = 0;
-        nvlog->entries[i].already_written = 0;
+size_t nvlog_used() {
+    size_t used = 0;
+    for (int s = 0; s < NB_SEGMENTS; s++) {
+        used += segments[s].head - segments[s].tail;
     }
+    return used;
 }
 
 //-----------------------------------------------
-int nvlog_empty() { return (available_blocks >= LOG_SIZE); }
+size_t nvlog_records() {
+    size_t records = 0;
+    for (int s = 0; s < NB_SEGMENTS; s++) {
+        records += segments[s].added - segments[s].freed;
+    }
+    return records;
+}
+
+//-----------------------------------------------
+int nvlog_empty() { return nvlog_used() == 0; }
+
+//-----------------------------------------------
+// Small logs may fill up with less than MIN_BATCH_SIZE large records, and
+// a writer may find no room for a large one below both thresholds
+//-----------------------------------------------
+int flush_wanted(void *unused) {
+    return !wthread || nvlog_records() > MIN_BATCH_SIZE ||
+           nvlog_used() > NB_SEGMENTS * SEGMENT_SIZE / 2 ||
+           (atomic_load(&room_wanted) && !nvlog_empty());
+}
+
+//-----------------------------------------------
+// A record of *length bytes (and its padding) fits in one of the segments
+//-----------------------------------------------
+int log_has_room(void *length) {
+    size_t n = *(size_t *)length;
+    for (int s = 0; s < NB_SEGMENTS; s++) {
+        size_t head = segments[s].head;
+        size_t room = SEGMENT_SIZE - head % SEGMENT_SIZE;
+        size_t pad = n > room ? room : 0;
+        if (head + pad + n - segments[s].tail <= SEGMENT_SIZE) {
+            return 1;
+        }
+    }
+    return 0;
+}
 
 //-----------------------------------------------
 //          THREAD
 //-----------------------------------------------
 void *disk_write_loop() {
     while (wthread) {
-      if (LOG_SIZE - available_blocks > MIN_BATCH_SIZE) {
-	flush_batch();
-      } else {
-	//nanosleep(&time_sleep, NULL);
-      }
+        // Parks until a writer crosses the threshold
+        waitq_wait(&flusher_wq, flush_wanted, NULL);
+        if (wthread) {
+            flush_batch();
+        }
+    }
+    if (FLUSH_THREAD) {
+        printinfo(NVINFO, MAG "\t -- Flushing thread ended --" RST);
+    } else {
+        printinfo(NVINFO, MAG "\tNo flush thread to end." RST);
     }
-#ifdef FLUSH_THREAD
-    printinfo(NVINFO, MAG "\t -- Flushing thread ended --" RST);
-#else
-    printinfo(NVINFO, MAG "\tNo flush thread to end." RST);
-#endif
     return NULL;
 }
 
@@ -502,46 +1388,37 @@ void *disk_write_loop() {
 //-----------------------------------------------
 void nvlog_flush_file(int fd) {
     pthread_mutex_lock(&nvcache_flush_mutex);
-    size_t c_tail = (nvlog->nvlog_tail % LOG_SIZE), entries = 0;
-    size_t c_head = (nvlog_head % LOG_SIZE);
+    size_t entries = 0;
+    entry_list_t list = {NULL, 0, 0};
     if (trace(TRACE_FLUSH)) {
         printinfo(NVTRACE, "\t--- Flushing file %d ---", fd);
     }
 
-    for (c_tail = nvlog->nvlog_tail % LOG_SIZE; c_tail != c_head;
-         c_tail = (c_tail + 1) % LOG_SIZE) {
-        // printf("Flushing a log : nvlog_tail = %ld   nvlog_head = %ld \n",
-        // c_tail, c_head);
-        log_entry_t *l = &nvlog->entries[c_tail];
-        if (l->fd == fd) {
-            // ramcache_lock_page(fd, l->offset);
-            if (flush_to_disk(l)) {  // do not fsync after pwrite
-                ++entries;
-            }
-        }
-    }
-
-    musl_fsync(fd);  // only one fsync
+    collect_entries(fd, NULL, &list);
+    // ramcache_lock_page(fd, l->offset);
+    entries = flush_to_disk(&flushers[0], list.entries, list.count);
 
-    // mark as written
-    for (c_tail = nvlog->nvlog_tail % LOG_SIZE; c_tail != c_head;
-         c_tail = (c_tail + 1) % LOG_SIZE) {
-        log_entry_t *l = &nvlog->entries[c_tail];
-        if (l->fd == fd) {
-            l->already_written = 1;
-            clwb(l->already_written);
-            // ramcache_unlock_page(fd, l->offset);
+    // mark as written, the dirty level of their pages goes down once
+    for (size_t i = 0; i < list.count; i++) {
+        log_entry_t *l = list.entries[i];
+        if (!l->already_written) {
+            mark_written(l);
         }
+        // ramcache_unlock_page(fd, l->offset);
     }
     PFENCE();
+    free(list.entries);
     pthread_mutex_unlock(&nvcache_flush_mutex);
 
-#ifndef FLUSH_THREAD
-    printinfo(NVINFO, "\t--- Finished flushing file %d --- Total entries: %lu",
-              fd, entries);
-#endif
+    if (!FLUSH_THREAD) {  // Runtime setting, always defined
+        printinfo(NVINFO,
+                  "\t--- Finished flushing file %d --- Total entries: %lu", fd,
+                  entries);
+    }
 }
 
+//-----------------------------------------------
+// Persisted by the caller, with the other records of the batch
 //-----------------------------------------------
 void mark_written(log_entry_t *log_entry) {
 #ifndef USE_LINUXCACHE
@@ -554,53 +1431,377 @@ void mark_written(log_entry_t *log_entry) {
 
     log_entry->already_written = 1;
     clwb(log_entry->already_written);
-    PFENCE();
 }
 
 //-----------------------------------------------
-void free_log_entry(log_entry_t *log_entry) {
-    atomic_store_explicit(&log_entry->committed, 0, memory_order_release);
-    clwb(log_entry->committed);
-
-    log_entry->waiting = INVALID_STATE;
-    clwb(log_entry->waiting);
-
-    nvlog->nvlog_tail = (nvlog->nvlog_tail + 1) % LOG_SIZE;
-    clwb(nvlog->nvlog_tail);
-    PFENCE();
+// Removes the written records from the tail of segment s (up to end) from the
+// index, and returns the new tail. The caller persists it and then publishes
+// it. The records themselves are left as is: once behind the tail, their
+// position can no more be reached by the recovery.
+// The records of a write are only freed once its first record is written:
+// until then, the recovery counts them to know if the write is complete.
+//-----------------------------------------------
+size_t free_records(int s, size_t end, size_t *records) {
+    size_t tail = segments[s].tail;
+    *records = 0;
+    while (tail < end) {
+        log_entry_t *log_entry = record_at(s, tail);
+        if (!log_entry->already_written) {
+            break;
+        }
+        int ws = log_entry->waiting_segment;
+        size_t waiting = log_entry->waiting;
+        if (waiting >= segments[ws].tail &&
+            !record_at(ws, waiting)->already_written) {
+            break;
+        }
+        // Only the files cached in RAM are indexed (see log_payload())
+        if (log_entry->fd != NVLOG_PADDING && !is_writeonly(log_entry->fd)) {
+            log_index_remove(log_entry->fd, log_entry->offset, log_entry->size,
+                             s, tail);
+        }
+        tail += log_entry->length;
+        ++*records;
+    }
+    return tail;
+}
 
-    atomic_fetch_add(&available_blocks, 1);
+//-----------------------------------------------
+//          Coalescing write-back
+//-----------------------------------------------
+int compare_extent(const void *a, const void *b) {
+    log_entry_t *x = *(log_entry_t **)a, *y = *(log_entry_t **)b;
+    if (x->fd != y->fd) {
+        return x->fd < y->fd ? -1 : 1;
+    }
+    if (x->offset != y->offset) {
+        return x->offset < y->offset ? -1 : 1;
+    }
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
 }
 
 //-----------------------------------------------
-int log_to_socache(log_entry_t *log_entry) {
-    int ret = musl_pwrite(log_entry->fd, log_entry->content, log_entry->size,
-                          log_entry->offset);
-    if (ret != log_entry->size) {
-        printinfo(NVCRIT, "Run to the hills size=%lu written=%d",
-                  log_entry->size, ret);
-	perror("Flushing to disk");
-        return 0;
+// Writes the entries that are not written yet, in as few system calls as
+// possible, and syncs the files written: they are sorted by file and offset,
+// and the entries that overlap or follow each other form one extent, written
+// with a single pwritev.
+// Returns the number of entries written.
+//-----------------------------------------------
+size_t flush_to_disk(flusher_t *f, log_entry_t **entries, size_t count) {
+    size_t written = 0, n = 0;
+    log_entry_t **sorted = malloc(count * sizeof(log_entry_t *));
+    for (size_t i = 0; i < count; i++) {
+        if (!entries[i]->already_written) {
+            sorted[n++] = entries[i];
+        }
+    }
+    qsort(sorted, n, sizeof(log_entry_t *), compare_extent);
+
+    f->plan.nb_extents = 0;
+    f->plan.nb_iov = 0;
+    size_t last;
+    for (size_t first = 0; first < n; first = last) {
+        size_t end = sorted[first]->offset + sorted[first]->size;
+        for (last = first + 1; last < n && sorted[last]->fd == sorted[first]->fd &&
+                               sorted[last]->offset <= end;
+             last++) {
+            end = max(end, sorted[last]->offset + sorted[last]->size);
+        }
+        written += plan_extent(&f->plan, sorted + first, last - first, end);
+    }
+
+    if (f->uring_ready) {
+        write_plan_uring(f);
     } else {
-        ++flushed_entries;
-        return ret;
+        write_plan_sync(&f->plan);
     }
+    free(sorted);
+    flushed_entries += written;
+    return written;
 }
 
 //-----------------------------------------------
-size_t flush_to_disk(log_entry_t *log_entry) {
-    if (log_entry->already_written) {
-        return 0;
-    }
+// run is sorted by offset and covers [run[0]->offset, end) without hole.
+// Each byte is taken from the most recent entry (highest seq) covering it:
+// the bytes overwritten inside the run are never written, and an entry fully
+// overwritten is dropped.
+//-----------------------------------------------
+size_t plan_extent(write_plan_t *plan, log_entry_t **run, size_t count,
+                   size_t end) {
+    int fd = run[0]->fd;
+    size_t pos = run[0]->offset;
+    size_t first = 0;  // Entries before first end before pos
+    extent_t *extent = NULL;
 
     if (trace(TRACE_DISK_WRITE)) {
         printinfo(NVTRACE,
-                  MAG
-                  "NVlog : Write to disk : Entry (fd=%d, off=%ld, size=%ld)",
-                  log_entry->fd, log_entry->offset, log_entry->size);
+                  MAG "NVlog : Write to disk : Extent (fd=%d, off=%ld, "
+                  "size=%ld, entries=%ld)",
+                  fd, pos, end - pos, count);
+    }
+
+    while (pos < end) {
+        log_entry_t *best = NULL;
+        size_t next = end;  // Where an other entry may take over
+        while (run[first]->offset + run[first]->size <= pos) {
+            ++first;
+        }
+        for (size_t i = first; i < count; i++) {
+            log_entry_t *e = run[i];
+            if (e->offset > pos) {
+                next = min(next, e->offset);
+                break;
+            }
+            if (e->offset + e->size > pos && (best == NULL || e->seq > best->seq)) {
+                best = e;
+            }
+        }
+        size_t piece_end = min(next, best->offset + best->size);
+        char *from = best->content + (pos - best->offset);
+        struct iovec *prev = extent ? &plan->iov[plan->nb_iov - 1] : NULL;
+
+        if (prev && (char *)prev->iov_base + prev->iov_len == from) {
+            prev->iov_len += piece_end - pos;
+        } else {
+            if (extent == NULL || extent->iovcnt == IOV_MAX) {
+                extent = plan_new_extent(plan, fd, pos);
+            }
+            if (plan->nb_iov == plan->max_iov) {
+                plan->max_iov = plan->max_iov ? 2 * plan->max_iov : 256;
+                plan->iov = realloc(plan->iov, plan->max_iov * sizeof(struct iovec));
+            }
+            plan->iov[plan->nb_iov].iov_base = from;
+            plan->iov[plan->nb_iov].iov_len = piece_end - pos;
+            plan->nb_iov++;
+            extent->iovcnt++;
+        }
+        extent->size += piece_end - pos;
+        pos = piece_end;
+    }
+    return count;
+}
+
+//-----------------------------------------------
+extent_t *plan_new_extent(write_plan_t *plan, int fd, size_t offset) {
+    if (plan->nb_extents == plan->max_extents) {
+        plan->max_extents = plan->max_extents ? 2 * plan->max_extents : 64;
+        plan->extents = realloc(plan->extents, plan->max_extents * sizeof(extent_t));
+    }
+    extent_t *extent = &plan->extents[plan->nb_extents++];
+    extent->fd = plan->fd_map ? plan->fd_map[fd] : fd;
+    extent->offset = offset;
+    extent->size = 0;
+    extent->iov = plan->nb_iov;
+    extent->iovcnt = 0;
+    return extent;
+}
+
+//-----------------------------------------------
+// pwritev is not intercepted by NVcache
+//-----------------------------------------------
+void write_plan_sync(write_plan_t *plan) {
+    for (size_t i = 0; i < plan->nb_extents; i++) {
+        extent_t *e = &plan->extents[i];
+        struct iovec *iov = &plan->iov[e->iov];
+        ssize_t ret = e->iovcnt == 1
+                          ? musl_pwrite(e->fd, iov->iov_base, e->size, e->offset)
+                          : pwritev(e->fd, iov, e->iovcnt, e->offset);
+        if (ret != e->size) {
+            printinfo(NVCRIT, "Run to the hills size=%lu written=%ld", e->size,
+                      ret);
+            perror("Flushing to disk");
+        }
+        // Extents are sorted by file
+        if (i + 1 == plan->nb_extents || plan->extents[i + 1].fd != e->fd) {
+            musl_fsync(e->fd);  // One fsync to rule them all !
+        }
     }
+}
 
-    return log_to_socache(log_entry);
+//-----------------------------------------------
+// The writes of a file are linked together and to its fsync, so that the
+// fsync only starts once they are done. The files proceed in parallel, up to
+// URING_DEPTH operations in flight.
+//-----------------------------------------------
+void write_plan_uring(flusher_t *f) {
+    write_plan_t *plan = &f->plan;
+    uring_t *ring = &f->ring;
+    unsigned errors = ring->errors;
+    size_t last;
+    for (size_t first = 0; first < plan->nb_extents; first = last) {
+        int fd = plan->extents[first].fd;
+        for (last = first + 1;
+             last < plan->nb_extents && plan->extents[last].fd == fd; last++) {
+        }
+        unsigned chain = last - first + 1;
+        int link = chain <= ring->depth;
+
+        if (!link) {
+            // Too long to be linked: the writes are waited for
+            for (size_t i = first; i < last; i++) {
+                if (!uring_space(ring)) {
+                    uring_submit(ring);
+                    uring_reap(ring, 1);
+                }
+                uring_queue_extent(f, &plan->extents[i], 0);
+            }
+            uring_submit(ring);
+            uring_reap(ring, ring->inflight);
+            chain = 1;
+        }
+        if (uring_space(ring) < chain) {
+            uring_submit(ring);  // A chain is never split
+            uring_reap(ring, chain - uring_space(ring));
+        }
+        if (link) {
+            for (size_t i = first; i < last; i++) {
+                uring_queue_extent(f, &plan->extents[i], 1);
+            }
+        }
+        uring_fsync(ring, fd);
+    }
+    uring_submit(ring);
+    uring_reap(ring, ring->inflight);  // Before the entries are freed
+
+    if (ring->errors != errors) {
+        // A write failed, and the rest of its chain was cancelled: the
+        // plan is written again like the synchronous engine does, which
+        // reports what still fails
+        printinfo(NVCRIT, "io_uring: %u failed writes, writing again",
+                  ring->errors - errors);
+        write_plan_sync(plan);
+    }
+}
+
+//-----------------------------------------------
+void uring_queue_extent(flusher_t *f, extent_t *e, int link) {
+    uring_writev(&f->ring, e->fd, &f->plan.iov[e->iov], e->iovcnt, e->offset,
+                 e->size, link);
+}
+
+//-----------------------------------------------
+//          Flusher pool
+//-----------------------------------------------
+void init_flushers() {
+    if (FLUSH_THREAD) {
+        nb_flushers = max(1, min(FLUSH_THREADS, MAX_FILES));
+    }
+    flushers = calloc(nb_flushers, sizeof(flusher_t));
+    for (int i = 0; i < nb_flushers; i++) {
+        flusher_t *f = &flushers[i];
+        f->writes =
+            malloc((MAX_BATCH_SIZE + MAX_PAGE_IMAGES) * sizeof(log_entry_t *));
+        if (FLUSH_ENGINE == FLUSH_ENGINE_URING) {
+            f->uring_ready = uring_init(&f->ring, URING_DEPTH) == 0;
+            if (!f->uring_ready) {
+                printinfo(NVCRIT, "io_uring unavailable, synchronous write-back");
+            }
+        }
+    }
+}
+
+//-----------------------------------------------
+// Flusher i runs on CPU i, next to the write thread (CPU 0)
+//-----------------------------------------------
+void start_flushers(pthread_attr_t *tattr) {
+    long nb_cpus = max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+    pool_running = 1;
+    for (int i = 1; i < nb_flushers; i++) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(i % nb_cpus, &cpus);
+        pthread_create(&flushers[i].thread, tattr, flusher_loop, &flushers[i]);
+        pthread_setaffinity_np(flushers[i].thread, sizeof(cpus), &cpus);
+    }
+    if (nb_flushers > 1) {
+        printinfo(NVINFO, MAG " -- %d flushing threads --" RST, nb_flushers);
+    }
+}
+
+//-----------------------------------------------
+// The write thread is stopped first: no batch is in progress
+//-----------------------------------------------
+void stop_flushers() {
+    if (pool_running) {
+        pthread_mutex_lock(&pool_mutex);
+        pool_running = 0;
+        pthread_cond_broadcast(&pool_work);
+        pthread_mutex_unlock(&pool_mutex);
+        for (int i = 1; i < nb_flushers; i++) {
+            pthread_join(flushers[i].thread, NULL);
+        }
+    }
+
+    // The final flush goes on with flusher 0, synchronously
+    pthread_mutex_lock(&nvcache_flush_mutex);
+    for (int i = 0; i < nb_flushers; i++) {
+        if (flushers[i].uring_ready) {
+            uring_exit(&flushers[i].ring);
+            flushers[i].uring_ready = 0;
+        }
+    }
+    pthread_mutex_unlock(&nvcache_flush_mutex);
+}
+
+//-----------------------------------------------
+void *flusher_loop(void *arg) {
+    flusher_t *f = arg;
+    size_t batch = 0;
+    pthread_mutex_lock(&pool_mutex);
+    while (1) {
+        while (pool_running && pool_batch == batch) {
+            pthread_cond_wait(&pool_work, &pool_mutex);
+        }
+        if (!pool_running) {
+            break;
+        }
+        batch = pool_batch;
+        pthread_mutex_unlock(&pool_mutex);
+
+        flush_to_disk(f, f->writes, f->nb_writes);
+
+        pthread_mutex_lock(&pool_mutex);
+        if (--pool_pending == 0) {
+            pthread_cond_signal(&pool_done);
+        }
+    }
+    pthread_mutex_unlock(&pool_mutex);
+    return NULL;
+}
+
+//-----------------------------------------------
+// Writes back a batch with the whole pool. The files are partitioned between
+// the flushers: all the entries of a file go to the same flusher, that keeps
+// their order (see plan_extent()). Returns once every entry is durable, so
+// that the caller only advances the tails over durable entries.
+//-----------------------------------------------
+void write_back(log_entry_t **entries, size_t count) {
+    if (!pool_running || nb_flushers == 1) {
+        flush_to_disk(&flushers[0], entries, count);
+        return;
+    }
+
+    for (int i = 0; i < nb_flushers; i++) {
+        flushers[i].nb_writes = 0;
+    }
+    for (size_t i = 0; i < count; i++) {
+        flusher_t *f = &flushers[entries[i]->fd % nb_flushers];
+        f->writes[f->nb_writes++] = entries[i];
+    }
+
+    pthread_mutex_lock(&pool_mutex);
+    pool_pending = nb_flushers - 1;
+    ++pool_batch;
+    pthread_cond_broadcast(&pool_work);
+    pthread_mutex_unlock(&pool_mutex);
+
+    flush_to_disk(&flushers[0], flushers[0].writes, flushers[0].nb_writes);
+
+    pthread_mutex_lock(&pool_mutex);
+    while (pool_pending) {
+        pthread_cond_wait(&pool_done, &pool_mutex);
+    }
+    pthread_mutex_unlock(&pool_mutex);
 }
 
 //-----------------------------------------------
@@ -635,71 +1836,370 @@ void flush_batch() {
 
 //-----------------------------------------------
 // committed == 1 guarantees that a write (which potentially touches multiple
-// pages) is finished.
+// pages) is finished. The other records of a write are committed before its
+// first one: they wait for it.
 //-----------------------------------------------
 int is_log_batchable(log_entry_t *log_entry) {
-    if (log_entry->committed) {
-        // Return 1 when trylock succeed
-        return 1;
+    if (!log_entry->committed) {
+        return 0;
+    }
+    int ws = log_entry->waiting_segment;
+    size_t waiting = log_entry->waiting;
+    if (waiting < segments[ws].tail) {
+        return 1;  // Freed, so written
+    }
+    log_entry_t *first = record_at(ws, waiting);
+    return record_valid(first, waiting) && first->committed;
+}
+
+//-----------------------------------------------
+// Write absorption: a newer record of the file covers the whole of this one,
+// and its write is complete. This one needs no write-back, the newer one
+// is written later, in a later batch at worst, as nothing is written before
+// an older record it overlaps (see __flush_batch()). Only the flusher frees
+// records: a newer record not behind the tail stays put meanwhile.
+// The newer record is the last one logged on the first page of this one
+// (see log_index_latest()): only the records of the files cached in RAM
+// are absorbed.
+//-----------------------------------------------
+int obsolete(log_entry_t *log_entry) {
+    int s;
+    size_t pos;
+    size_t page = log_entry->offset - log_entry->offset % RAM_PAGE_SIZE;
+    if (!log_index_latest(log_entry->fd, page, &s, &pos) ||
+        pos < segments[s].tail) {
+        return 0;
+    }
+    log_entry_t *newer = record_at(s, pos);
+    return record_valid(newer, pos) && newer->fd == log_entry->fd &&
+           newer->seq > log_entry->seq &&
+           newer->offset <= log_entry->offset &&
+           newer->offset + newer->size >=
+               log_entry->offset + log_entry->size &&
+           is_log_batchable(newer);
+}
+
+//-----------------------------------------------
+int overlaps_skipped(skipped_t *skipped, int nb, log_entry_t *entry) {
+    for (int i = 0; i < nb; i++) {
+        if (skipped[i].fd == entry->fd &&
+            skipped[i].start < entry->offset + entry->size &&
+            entry->offset < skipped[i].end) {
+            return 1;
+        }
     }
     return 0;
 }
 
+//-----------------------------------------------
+int compare_batch_page(const void *a, const void *b) {
+    const batch_page_t *pa = a, *pb = b;
+    if (pa->fd != pb->fd) {
+        return pa->fd < pb->fd ? -1 : 1;
+    }
+    return pa->base < pb->base ? -1 : pa->base > pb->base;
+}
+
+//-----------------------------------------------
+batch_page_t *batch_page(batch_page_t *pages, size_t nb, int fd,
+                         size_t base) {
+    batch_page_t key = {fd, base, NULL};
+    return bsearch(&key, pages, nb, sizeof(batch_page_t), compare_batch_page);
+}
+
+//-----------------------------------------------
+// The walk of a batch stops at cursor[s] in segment s, a record below it was
+// visited: written, absorbed or skipped by the batch, or written before.
+//-----------------------------------------------
+int reached_by_batch(log_entry_t *log_entry, size_t *cursor) {
+    int s = ((char *)log_entry - nvlog->records) / SEGMENT_SIZE;
+    return atomic_load(&log_entry->lsn) < cursor[s];
+}
+
+//-----------------------------------------------
+// Page write-back (WRITE_BACK_PAGES): the dirty pages of the batch cached in
+// RAM are written once each, from a copy of the page (see
+// ramcache_page_image()), however many records they got. A record of the
+// batch that only covers such pages is not written, only freed, and so are
+// the records the batch did not reach that only cover one page, committed
+// before the copy: they are in it. These are only taken if no record left on
+// the page is written later, an older one would overwrite them. Reached
+// means below the cursors of the batch (see reached_by_batch()), not older
+// than its last record: a seq is taken before the reservation, a record
+// reserved after the batch stopped may be older. The other records of
+// the batch are written as usual, under the images, which are newer than
+// any record (see plan_extent()). The images are appended to batch_writes,
+// the records of the batch not to write moved to batch_absorbed (their pages
+// are locked), the others to batch_reclaimed. Returns the images.
+//-----------------------------------------------
+size_t page_write_back(size_t *nb_writes, size_t *nb_absorbed,
+                       size_t *cursor, skipped_t *skipped, int nb_skipped) {
+    static batch_page_t *pages;
+    static size_t capacity;
+    size_t nb_pages = 0;
+
+    for (size_t i = 0; i < *nb_writes; i++) {
+        log_entry_t *e = batch_writes[i];
+        if (is_writeonly(e->fd) || !ramcache_exists(e->fd)) {
+            continue;
+        }
+        size_t first = e->offset - e->offset % RAM_PAGE_SIZE;
+        for (size_t base = first; base < e->offset + e->size;
+             base += RAM_PAGE_SIZE) {
+            if (nb_pages == capacity) {
+                capacity = capacity ? 2 * capacity : 256;
+                pages = realloc(pages, capacity * sizeof(batch_page_t));
+            }
+            pages[nb_pages].fd = e->fd;
+            pages[nb_pages].base = base;
+            pages[nb_pages].image = NULL;
+            nb_pages++;
+        }
+    }
+    qsort(pages, nb_pages, sizeof(batch_page_t), compare_batch_page);
+    size_t unique = 0;
+    for (size_t i = 0; i < nb_pages; i++) {
+        if (!unique || compare_batch_page(&pages[unique - 1], &pages[i])) {
+            pages[unique++] = pages[i];
+        }
+    }
+    nb_pages = unique;
+
+    // The records of each page are read before its copy: once committed,
+    // they are in it
+    entry_list_t indexed = {NULL, 0, 0};
+    size_t nb_images = 0;
+    for (size_t i = 0; i < nb_pages && nb_images < MAX_PAGE_IMAGES; i++) {
+        batch_page_t *pg = &pages[i];
+        size_t reclaimed = batch_reclaimed.count;
+        int complete = 1;
+        indexed.count = 0;
+        log_index_foreach(pg->fd, pg->base, collect_indexed, &indexed);
+        for (size_t j = 0; j < indexed.count && complete; j++) {
+            log_entry_t *e = indexed.entries[j];
+            if (e->already_written) {
+                continue;
+            }
+            if (overlaps_skipped(skipped, nb_skipped, e)) {
+                complete = 0;
+            } else if (!reached_by_batch(e, cursor)) {
+                if (e->offset >= pg->base &&
+                    e->offset + e->size <= pg->base + RAM_PAGE_SIZE &&
+                    is_log_batchable(e)) {
+                    entry_list_add(&batch_reclaimed, e);
+                } else {
+                    complete = 0;
+                }
+            }
+        }
+
+        log_entry_t *image =
+            (log_entry_t *)(page_images + nb_images * IMAGE_STRIDE);
+        ssize_t size = ramcache_page_image(pg->fd, pg->base, image->content);
+        if (!complete || size <= 0) {
+            batch_reclaimed.count = reclaimed;
+        }
+        if (size <= 0) {
+            continue;
+        }
+        image->fd = pg->fd;
+        image->offset = pg->base;
+        image->size = size;
+        image->seq = SIZE_MAX;
+        image->already_written = 0;
+        pg->image = image;
+        nb_images++;
+    }
+    free(indexed.entries);
+
+    size_t written = 0, covered = 0;
+    for (size_t i = 0; i < *nb_writes; i++) {
+        log_entry_t *e = batch_writes[i];
+        size_t first = e->offset - e->offset % RAM_PAGE_SIZE;
+        int paged = nb_images > 0;
+        for (size_t base = first; paged && base < e->offset + e->size;
+             base += RAM_PAGE_SIZE) {
+            batch_page_t *pg = batch_page(pages, nb_pages, e->fd, base);
+            paged = pg != NULL && pg->image != NULL;
+        }
+        if (paged) {
+            batch_absorbed[(*nb_absorbed)++] = e;
+            covered++;
+        } else {
+            batch_writes[written++] = e;
+        }
+    }
+    *nb_writes = written;
+    for (size_t i = 0; i < nb_images; i++) {
+        batch_writes[written + i] =
+            (log_entry_t *)(page_images + i * IMAGE_STRIDE);
+    }
+    paged_entries += covered + batch_reclaimed.count;
+    paged_images += nb_images;
+    return nb_images;
+}
+
+//-----------------------------------------------
+// Merges the segments: returns the oldest entry after the cursors, or NULL
+// if the log is empty or the order cannot be decided yet (a record is
+// reserved but its header is not written).
+//-----------------------------------------------
+log_entry_t *next_in_order(size_t *cursor, int *segment) {
+    log_entry_t *oldest = NULL;
+    size_t oldest_seq = 0;
+    for (int s = 0; s < NB_SEGMENTS; s++) {
+        if (cursor[s] == segments[s].head) {
+            continue;
+        }
+        log_entry_t *log_entry = record_at(s, cursor[s]);
+        if (!record_valid(log_entry, cursor[s])) {
+            return NULL;
+        }
+        size_t seq = log_entry->seq;
+        if (oldest == NULL || seq < oldest_seq) {
+            oldest = log_entry;
+            oldest_seq = seq;
+            *segment = s;
+        }
+    }
+    return oldest;
+}
+
+//-----------------------------------------------
+// Writes the log in order, but does not stop at a record it cannot write yet
+// (not committed, or one of its pages locked by a reader): it is skipped, and
+// so are the later records that overlap it, each file still gets its writes
+// in order. The records written are marked already_written, and each segment
+// is then freed up to its first record that is not. The batch stops at a
+// header that is not published yet, its file is unknown.
 //-----------------------------------------------
 int __flush_batch() {
-    int batch_size = 0;
+    size_t nb_writes = 0, nb_absorbed = 0, visited = 0;
+    int freed = 0;
     if (nvlog_empty()) {  // Log empty
-        return batch_size;
+        return freed;
+    }
+
+    size_t cursor[NVLOG_MAX_SEGMENTS];
+    for (int s = 0; s < NB_SEGMENTS; s++) {
+        cursor[s] = segments[s].tail;
     }
+    skipped_t skipped[MAX_SKIPPED];
+    int nb_skipped = 0;
 
-    log_entry_t *log_entry = &nvlog->entries[(nvlog->nvlog_tail)];
+    int s;
+    log_entry_t *log_entry = next_in_order(cursor, &s);
 
-    while ((batch_size < MAX_BATCH_SIZE) && is_log_batchable(log_entry)) {
+    while (visited < MAX_BATCH_SIZE && log_entry != NULL) {
         if (!log_entry->already_written) {
-            int ret = ramcache_trylock_radix_pages(log_entry->fd, log_entry->offset,
-                                             log_entry->size);
-            if (ret) {
+            if (!overlaps_skipped(skipped, nb_skipped, log_entry) &&
+                is_log_batchable(log_entry) &&
+                !ramcache_trylock_radix_pages(log_entry->fd, log_entry->offset,
+                                              log_entry->size)) {
+                // Locked even if absorbed: a reader of its pages may use it
+                if (obsolete(log_entry)) {
+                    batch_absorbed[nb_absorbed++] = log_entry;
+                } else {
+                    batch_writes[nb_writes++] = log_entry;
+                }
+            } else if (nb_skipped < MAX_SKIPPED) {
+                skipped[nb_skipped].fd = log_entry->fd;
+                skipped[nb_skipped].start = log_entry->offset;
+                skipped[nb_skipped].end = log_entry->offset + log_entry->size;
+                nb_skipped++;
+            } else {
                 break;
             }
-            flush_to_disk(log_entry);  // do not fsync after pwrite
-            files_to_fsync[log_entry->fd] = 1;
         }
 
-        ++batch_size;
-
-        log_entry =
-            &nvlog->entries[(nvlog->nvlog_tail + batch_size) % LOG_SIZE];
+        visited++;
+        cursor[s] += log_entry->length;
+        log_entry = next_in_order(cursor, &s);
     }
+    absorbed_entries += nb_absorbed;
 
-    if (batch_size == 0) {  // i.e. first is not commited or page locked
-        return batch_size;
+    if (trace(TRACE_FLUSH)) {
+        printinfo(NVTRACE,
+                  RED " FLUSH BATCH : WRITING %lu LOG ENTRIES, %lu ABSORBED, "
+                  "%d SKIPPED" RST,
+                  nb_writes, nb_absorbed, nb_skipped);
     }
 
-    if (trace(TRACE_FLUSH)) {
-        printinfo(NVTRACE, RED " FLUSH BATCH : WRITING %d LOG ENTRIES" RST,
-                  batch_size);
+    size_t nb_images = 0;
+    batch_reclaimed.count = 0;
+    if (WRITE_BACK == WRITE_BACK_PAGES && nb_writes) {
+        nb_images = page_write_back(&nb_writes, &nb_absorbed, cursor,
+                                    skipped, nb_skipped);
+    }
+    if (nb_writes + nb_images) {
+        write_back(batch_writes, nb_writes + nb_images);
     }
 
-    for (int i = 0; i < 1024; i++) {
-        if (files_to_fsync[i]) {
-            musl_fsync(i);  // One fsync to rule them all !
-            files_to_fsync[i] = 0;
+    // Persisted once for the whole batch, then the tails once per segment.
+    // The flags come first: a record written past a record left behind must
+    // not be replayed over a newer write freed meanwhile. They are set in
+    // the order of the log, absorbed and reclaimed records included: a crash
+    // in between must not leave an older record to replay over a newer one
+    // already marked. page_write_back() appended records out of that order.
+    // The pages are unlocked once all are set: a reclaimed record is not
+    // locked, a miss on its page would play the older records without it.
+    if (nb_images) {
+        qsort(batch_absorbed, nb_absorbed, sizeof(log_entry_t *), compare_seq);
+        qsort(batch_reclaimed.entries, batch_reclaimed.count,
+              sizeof(log_entry_t *), compare_seq);
+    }
+    for (size_t w = 0, a = 0, r = 0;;) {
+        log_entry_t *l = w < nb_writes ? batch_writes[w] : NULL;
+        size_t *next = &w;
+        if (a < nb_absorbed && (!l || batch_absorbed[a]->seq < l->seq)) {
+            l = batch_absorbed[a];
+            next = &a;
+        }
+        if (r < batch_reclaimed.count &&
+            (!l || batch_reclaimed.entries[r]->seq < l->seq)) {
+            l = batch_reclaimed.entries[r];
+            next = &r;
+        }
+        if (l == NULL) {
+            break;
         }
+        mark_written(l);
+        (*next)++;
+    }
+    for (size_t i = 0; i < nb_writes; i++) {
+        log_entry_t *l = batch_writes[i];
+        ramcache_unlock_radix_pages(l->fd, l->offset, l->size);
+    }
+    for (size_t i = 0; i < nb_absorbed; i++) {
+        log_entry_t *l = batch_absorbed[i];
+        ramcache_unlock_radix_pages(l->fd, l->offset, l->size);
+    }
+    if (nb_writes + nb_absorbed + batch_reclaimed.count) {
+        PFENCE();
     }
 
-    for (int i = 0; i < batch_size; i++) {
-        log_entry_t *l = &nvlog->entries[nvlog->nvlog_tail];
-        int fd = l->fd;
-        off_t off = l->offset;
-        int size = l->size;
-        int already_written = l->already_written;
-        mark_written(l);
-        free_log_entry(l);
-        if (!already_written) {
-            int lockret = ramcache_unlock_radix_pages(fd, off, size);
+    size_t tails[NVLOG_MAX_SEGMENTS], records[NVLOG_MAX_SEGMENTS];
+    for (s = 0; s < NB_SEGMENTS; s++) {
+        tails[s] = free_records(s, cursor[s], &records[s]);
+        if (records[s]) {
+            nvlog->segments[s].tail = tails[s];
+            clwb(nvlog->segments[s].tail);
+            freed += records[s];
+        }
+    }
+    if (freed) {
+        PFENCE();
+    }
+    for (s = 0; s < NB_SEGMENTS; s++) {
+        if (records[s]) {
+            atomic_store(&segments[s].tail, tails[s]);
+            atomic_fetch_add(&segments[s].freed, records[s]);
         }
     }
-    return batch_size;
+    if (freed) {
+        waitq_notify(&room_wq);
+    }
+    return freed;
 }
 
 //-----------------------------------------------
@@ -711,189 +2211,43 @@ int __flush_batch() {
 void flush_with_clwb(volatile char *content, size_t count) {
     uintptr_t uptr;
 
+    if (!PWB_NEEDED) {
+        return;  // eADR: the stores are persistent once visible
+    }
+
     for (uptr = (uintptr_t)content & ~(FLUSH_ALIGN - 1);
          uptr < (uintptr_t)content + count; uptr += FLUSH_ALIGN) {
         PWB((char *)uptr);
     }
 }
 
-//-----------------------------------------------
-inline void ntstore(void* _dst, void* _src) {
-  unsigned long dst = (unsigned long) _dst;
-  unsigned long src = (unsigned long) _src;
-  __asm__ __volatile__(
-      "movq    (%0), %%r8\n"
-      "movnti  %%r8,   (%1)\n"
-      :: "r" (src), "r" (dst)
-      : "memory", "r8");
-}
-
-
-
-//-----------------------------------------------
-inline void *memcpy_ntstore(void *_dest, void *_src, size_t n){
-
-  unsigned long dst = (unsigned long) _dest;
-  unsigned long src = (unsigned long) _src;
-  
-  for(int i=0; i<=(n/8); i++){
-
-    __asm__(
-      "movq    (%0), %%r8\n"
-      "movnti  %%r8,   (%1)\n"
-      :: "r" (src), "r" (dst)
-      : "memory", "r8");
-    dst += 8;
-    src += 8;
-  }
-
-  return _dest;
-}
-
-//-----------------------------------------------
-inline void *memcpy_ntstore32(void *_dst, void *_src, size_t n){
-    unsigned long dst = (unsigned long) _dst;
-    unsigned long src = (unsigned long) _src;
-
-    for(int i=0; i<=(n/32)+1; i++){
-      __asm__(
-	   "   prefetchnta (%0)\n"
-	   "   prefetchnta 64(%0)\n"
-	   "   prefetchnta 128(%0)\n"
-	   "   prefetchnta 192(%0)\n"
-	   "   prefetchnta 256(%0)\n"
-	   "   prefetchnta 320(%0)\n"
-	   : : "r" (src) );
-      __asm__(
-	  "movq  (%0), %%mm0\n"
-	  "movq 8(%0), %%mm1\n"
-	  "movq 16(%0), %%mm2\n"
-	  "movq 24(%0), %%mm3\n"
-	  "movq 32(%0), %%mm4\n"
-	  "movq 40(%0), %%mm5\n"
-	  "movq 48(%0), %%mm6\n"
-	  "movq 56(%0), %%mm7\n"
-	  "movntq %%mm0, (%1)\n"
-	  "movntq %%mm1, 8(%1)\n"
-	  "movntq %%mm2, 16(%1)\n"
-	  "movntq %%mm3, 24(%1)\n"
-	  "movntq %%mm4, 32(%1)\n"
-	  "movntq %%mm5, 40(%1)\n"
-	  "movntq %%mm6, 48(%1)\n"
-	  "movntq %%mm7, 56(%1)\n"
-	  :: "r" (src), "r" (dst)
-	  : "memory");
-
-      dst += 32;
-      src += 32;
-    }
-
-    return _dst;
-}
-
-//-----------------------------------------------
-inline void memcpy_ntstore_nova(void *_to, void *_from){
-
-  unsigned long to = (unsigned long) _to;
-  unsigned long from = (unsigned long) _from;
-
-  int i;
-  
-  __asm__ __volatile__(
-		       "1: prefetch (%0)\n"
-		       "   prefetch 64(%0)\n"
-		       "   prefetch 128(%0)\n"
-		       "   prefetch 192(%0)\n"
-		       "   prefetch 256(%0)\n"
-		       "2:  \n"
-		       ".section .fixup, \"ax\"\n"
-		       "3: movw $0x1AEB, 1b\n"	/* jmp on 26 bytes */
-		       "   jmp 2b\n"
-		       ".previous\n"
-		       :: "r" (from));
-
-  for (i = 0; i < (4096-320)/64; i++) {
-    __asm__ __volatile__ (
-			  "1: prefetch 320(%0)\n"
-			  "2: movq (%0), %%mm0\n"
-			  "   movntq %%mm0, (%1)\n"
-			  "   movq 8(%0), %%mm1\n"
-			  "   movntq %%mm1, 8(%1)\n"
-			  "   movq 16(%0), %%mm2\n"
-			  "   movntq %%mm2, 16(%1)\n"
-			  "   movq 24(%0), %%mm3\n"
-			  "   movntq %%mm3, 24(%1)\n"
-			  "   movq 32(%0), %%mm4\n"
-			  "   movntq %%mm4, 32(%1)\n"
-			  "   movq 40(%0), %%mm5\n"
-			  "   movntq %%mm5, 40(%1)\n"
-			  "   movq 48(%0), %%mm6\n"
-			  "   movntq %%mm6, 48(%1)\n"
-			  "   movq 56(%0), %%mm7\n"
-			  "   movntq %%mm7, 56(%1)\n"
-			  ".section .fixup, \"ax\"\n"
-			  "3: movw $0x05EB, 1b\n"	/* jmp on 5 bytes */
-			  "   jmp 2b\n"
-			  ".previous\n"
-			  :: "r" (from), "r" (to)
-			  : "memory");
-
-    from += 64;
-    to += 64;
-  }
-
-  for (i = (4096-320)/64; i < 4096/64; i++) {
-    __asm__ __volatile__ (
-			  "2: movq (%0), %%mm0\n"
-			  "   movntq %%mm0, (%1)\n"
-			  "   movq 8(%0), %%mm1\n"
-			  "   movntq %%mm1, 8(%1)\n"
-			  "   movq 16(%0), %%mm2\n"
-			  "   movntq %%mm2, 16(%1)\n"
-			  "   movq 24(%0), %%mm3\n"
-			  "   movntq %%mm3, 24(%1)\n"
-			  "   movq 32(%0), %%mm4\n"
-			  "   movntq %%mm4, 32(%1)\n"
-			  "   movq 40(%0), %%mm5\n"
-			  "   movntq %%mm5, 40(%1)\n"
-			  "   movq 48(%0), %%mm6\n"
-			  "   movntq %%mm6, 48(%1)\n"
-			  "   movq 56(%0), %%mm7\n"
-			  "   movntq %%mm7, 56(%1)\n"
-			  : : "r" (from), "r" (to) : "memory");
-    from += 64;
-    to += 64;
-  }
-
-}
-
-
-    
 //-----------------------------------------------
 // For debug only
 void gdb_print_log() {
     printinfo(NVTRACE,
-              "+---------+----+----------+--------+--------+---------+---------"
-              "--------+");
-    size_t c_disk_tail = nvlog->nvlog_tail;
+              "+-----+---------+----+----------+--------+--------+---------+----"
+              "-------------+");
     printinfo(NVTRACE,
-              "|  Index  | Fd |  Offset  |  Size  | Commit | Waiting | Already "
-              "written |");
+              "| Seg |   Pos   | Fd |  Offset  |  Size  | Commit | Waiting | "
+              "Already written |");
     printinfo(NVTRACE,
-              "+---------+----+----------+--------+--------+---------+---------"
-              "--------+");
-    while (!nvlog_empty() && (c_disk_tail != nvlog_head % LOG_SIZE)) {
-        log_entry_t *entry = &nvlog->entries[c_disk_tail];
-
-        printinfo(NVTRACE, "|%9ld|%4d|%10ld|%8d|%8d|%9d|%17d|", c_disk_tail,
-                  entry->fd, entry->offset, entry->size, entry->committed,
-                  entry->waiting, entry->already_written);
-        c_disk_tail = (c_disk_tail + 1) % LOG_SIZE;
+              "+-----+---------+----+----------+--------+--------+---------+----"
+              "-------------+");
+    for (int s = 0; s < NB_SEGMENTS; s++) {
+        for (size_t pos = segments[s].tail; pos != segments[s].head;
+             pos += record_at(s, pos)->length) {
+            log_entry_t *entry = record_at(s, pos);
+
+            printinfo(NVTRACE, "|%5d|%9ld|%4d|%10ld|%8d|%8d|%9d|%17d|", s,
+                      pos, entry->fd, entry->offset, entry->size,
+                      entry->committed, entry->waiting,
+                      entry->already_written);
+        }
     }
 
     printinfo(NVTRACE,
-              "+---------+----+----------+--------+--------+---------+---------"
-              "--------+");
+              "+-----+---------+----+----------+--------+--------+---------+----"
+              "-------------+");
 }
 
 void gdb_print_concerned_logs(int fd, off_t offset) {
@@ -906,29 +2260,31 @@ void gdb_print_concerned_logs(int fd, off_t offset) {
     ram->fd = fd;
     ram->offset = offset;
     printinfo(NVTRACE,
-              "+---------+----+----------+--------+--------+---------+---------"
-              "--------+");
-    size_t c_disk_tail = nvlog->nvlog_tail;
+              "+-----+---------+----+----------+--------+--------+---------+----"
+              "-------------+");
     printinfo(NVTRACE,
-              "|  Index  | Fd |  Offset  |  Size  | Commit | Waiting | Already "
-              "written |");
+              "| Seg |   Pos   | Fd |  Offset  |  Size  | Commit | Waiting | "
+              "Already written |");
     printinfo(NVTRACE,
-              "+---------+----+----------+--------+--------+---------+---------"
-              "--------+");
-    while (!nvlog_empty() && (c_disk_tail != nvlog_head % LOG_SIZE)) {
-        log_entry_t *entry = &nvlog->entries[c_disk_tail];
-
-        if (page_concerned(entry, ram, orig, dest, size)) {
-            printinfo(NVTRACE, "|%9ld|%4d|%10ld|%8d|%8d|%9d|%17d|", c_disk_tail,
-                      entry->fd, entry->offset, entry->size, entry->committed,
-                      entry->waiting, entry->already_written);
+              "+-----+---------+----+----------+--------+--------+---------+----"
+              "-------------+");
+    for (int s = 0; s < NB_SEGMENTS; s++) {
+        for (size_t pos = segments[s].tail; pos != segments[s].head;
+             pos += record_at(s, pos)->length) {
+            log_entry_t *entry = record_at(s, pos);
+
+            if (page_concerned(entry, ram, orig, dest, size)) {
+                printinfo(NVTRACE, "|%5d|%9ld|%4d|%10ld|%8d|%8d|%9d|%17d|", s,
+                          pos, entry->fd, entry->offset,
+                          entry->size, entry->committed, entry->waiting,
+                          entry->already_written);
+            }
         }
-        c_disk_tail = (c_disk_tail + 1) % LOG_SIZE;
     }
 
     printinfo(NVTRACE,
-              "+---------+----+----------+--------+--------+---------+---------"
-              "--------+");
+              "+-----+---------+----+----------+--------+--------+---------+----"
+              "-------------+");
 }
 
 //-----------------------------------------------
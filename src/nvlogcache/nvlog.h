@@ -20,12 +20,13 @@ extern long __min_batch_size;
 
 #ifdef NVCACHE_STATIC_CONF
 
+// Bytes of PMEM used by the log
 #if defined BIG_LOG
-#define LOG_SIZE 5000000
+#define LOG_SIZE 40000000000L
 #elif defined MEDIUM_LOG
-#define LOG_SIZE 50000
+#define LOG_SIZE 400000000L
 #elif defined SMALL_LOG
-#define LOG_SIZE 500
+#define LOG_SIZE 4000000L
 #else
 #error \
     "You must define either BIG or SMALL_LOG to choose the size of the NVlog."
@@ -36,14 +37,13 @@ extern long __min_batch_size;
 
 #define FLUSH_ALIGN ((uintptr_t)64)
 
-// Value of nvlog.nvlog_tail meaning the log has been recovered but still needs
-// to be reset. This state cannot be reached in a normal execution.
-#define INVALID_STATE LOG_SIZE
+// Value of log_entry_t.fd for the records skipping the end of a segment
+#define NVLOG_PADDING -1
 
-#define PMEM_PATH "/dev/dax1.0"
-//#define PMEM_PATH "/mnt/pmem1/pool"
-//#define PMEM_PATH "/dev/pmem1" // NUMA node 1
-//#define PMEM_PATH "/home/ubuntu/nvcache-ng.cache"
+// Values of nvlog.nvlog_state. NVLOG_CLEAN means there is nothing to recover:
+// the log has been flushed on exit, or recovered but still needs to be reset.
+#define NVLOG_CLEAN 0
+#define NVLOG_ACTIVE 1
 
 #ifdef __cplusplus
 extern "C" {
@@ -51,9 +51,10 @@ extern "C" {
 
 
 
-atomic_size_t added_entries, flushed_entries, available_blocks;
+atomic_size_t added_entries, flushed_entries;
   
 void nvlog_init(void);
+size_t nvlog_used(void);
 void nvlog_add_entry(int fd, size_t offset, const char *content, size_t count);
 int nvlog_play_log_on_page(int fd, page *p);
 void nvlog_final_flush(void);
@@ -0,0 +1,246 @@
+#define _GNU_SOURCE
+#include "pmem.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "nvinfo.h"
+
+//-----------------------------------------------
+// Persistence backends for the NVlog.
+//
+//  - DAX  : the real thing. A devdax device (or a file on a fsdax mount)
+//           mapped with MAP_SYNC, PWB/PFENCE are the only costs.
+//  - FILE : a plain file (tmpfs, ext4...). Survives a process crash but not
+//           a power failure. PWB/PFENCE costs are emulated.
+//  - DRAM : anonymous memory. Nothing survives, recovery is never needed.
+//           PWB/PFENCE costs are emulated.
+//
+// The emulated backends let the whole write path run (and be benchmarked)
+// on machines without PMEM.
+//-----------------------------------------------
+
+//-----------------------------------------------
+//             NOT EXPORTED
+//-----------------------------------------------
+static int pmem_fd = -1;
+
+#define MAX_NVDIMM_REGIONS 64  // Looked up for eADR
+
+static void *map_dax(size_t size, int *fresh);
+static void *map_file(size_t size, int *fresh);
+static void *map_dram(size_t size, int *fresh);
+static void pmem_fatal(const char *what);
+static void select_pwb(void);
+static int eadr(void);
+//-----------------------------------------------
+
+const char *pmem_backend_name(int backend) {
+    switch (backend) {
+        case PMEM_BACKEND_DAX:
+            return "dax";
+        case PMEM_BACKEND_FILE:
+            return "file (emulated)";
+        case PMEM_BACKEND_DRAM:
+            return "dram (emulated)";
+        default:
+            return "unknown";
+    }
+}
+
+//-----------------------------------------------
+char *pmem_default_path(int backend) {
+    switch (backend) {
+        case PMEM_BACKEND_DAX:
+            return "/dev/dax1.0";
+            // return "/mnt/pmem1/pool";
+            // return "/dev/pmem1"; // NUMA node 1
+        case PMEM_BACKEND_FILE:
+            return "/dev/shm/nvcache-pmem";
+        default:
+            return NULL;
+    }
+}
+
+//-----------------------------------------------
+// Maps size bytes of persistent memory. *fresh is set when the mapping is
+// known to hold no previous log (new file, anonymous memory), in which case
+// there is nothing to recover.
+//-----------------------------------------------
+void *pmem_map(size_t size, int *fresh) {
+    *fresh = 0;
+    printinfo(NVINFO, MAG "PMEM backend: %s (%s), %lu MB" RST,
+              pmem_backend_name(PMEM_BACKEND), PMEM_PATH ? PMEM_PATH : "-",
+              size / 1024 / 1024);
+
+    select_pwb();
+
+    switch (PMEM_BACKEND) {
+        case PMEM_BACKEND_DAX:
+            return map_dax(size, fresh);
+        case PMEM_BACKEND_FILE:
+            return map_file(size, fresh);
+        case PMEM_BACKEND_DRAM:
+            return map_dram(size, fresh);
+        default:
+            printinfo(NVCRIT, "Unknown PMEM backend %d", PMEM_BACKEND);
+            exit(EXIT_FAILURE);
+    }
+}
+
+//-----------------------------------------------
+const char *pmem_pwb_name(int pwb) {
+    switch (pwb) {
+        case PWB_CLFLUSH:
+            return "clflush";
+        case PWB_CLFLUSHOPT:
+            return "clflushopt";
+        case PWB_CLWB:
+            return "clwb";
+        case PWB_NONE:
+            return "none (eADR)";
+        default:
+            return "unknown";
+    }
+}
+
+//-----------------------------------------------
+void *map_dax(size_t size, int *fresh) {
+    pmem_fd = musl_open(PMEM_PATH, O_RDWR, 0);
+    if (pmem_fd == -1) {
+        pmem_fatal("Pmem");
+    }
+
+    void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED_VALIDATE | MAP_SYNC, pmem_fd, 0);
+    if (addr == MAP_FAILED) {
+        pmem_fatal("Nvlog mmap (is it a DAX device?)");
+    }
+    return addr;
+}
+
+//-----------------------------------------------
+void *map_file(size_t size, int *fresh) {
+    struct stat st;
+    pmem_fd = musl_open(PMEM_PATH, O_RDWR | O_CREAT, 0600);
+    if (pmem_fd == -1 || musl_fstat(pmem_fd, &st) == -1) {
+        pmem_fatal("Pmem file");
+    }
+
+    if (st.st_size < (off_t)size) {
+        *fresh = (st.st_size == 0);
+        if (ftruncate(pmem_fd, size) == -1) {
+            pmem_fatal("Pmem file truncate");
+        }
+    }
+
+    void *addr =
+        mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, pmem_fd, 0);
+    if (addr == MAP_FAILED) {
+        pmem_fatal("Nvlog mmap");
+    }
+    return addr;
+}
+
+//-----------------------------------------------
+void *map_dram(size_t size, int *fresh) {
+    *fresh = 1;
+    void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (addr == MAP_FAILED) {
+        pmem_fatal("Nvlog mmap");
+    }
+    return addr;
+}
+
+//-----------------------------------------------
+// Carrying on without a log would only crash later on the first write.
+//-----------------------------------------------
+void pmem_fatal(const char *what) {
+    perror(what);
+    printinfo(NVCRIT, "Cannot map the NVlog on %s (backend: %s)",
+              PMEM_PATH ? PMEM_PATH : "-", pmem_backend_name(PMEM_BACKEND));
+    exit(EXIT_FAILURE);
+}
+
+//-----------------------------------------------
+// Busy waits for ns nanoseconds, like a stalled PWB/PFENCE would.
+//-----------------------------------------------
+void pmem_inject_latency(long ns) {
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while ((now.tv_sec - start.tv_sec) * 1000000000L +
+                 (now.tv_nsec - start.tv_nsec) <
+             ns);
+}
+
+//-----------------------------------------------
+// The PWB instruction, unless forced with NVCACHE_PWB. clwb writes the line
+// back and keeps it cached, clflushopt evicts it: both are only ordered by
+// PFENCE. clflush, on every x86-64, is slower and ordered by itself. When
+// the caches are part of the persistence domain (eADR), no PWB is needed.
+// The emulated backends keep the instruction, their costs are emulated.
+//-----------------------------------------------
+void select_pwb(void) {
+#ifdef PWB_IS_RUNTIME
+    unsigned int eax, ebx, ecx, edx;
+    int has[PWB_NONE + 1] = {1, 0, 0, 1};
+    __asm__("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0));
+    if (eax >= 7) {
+        __asm__("cpuid"
+                : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx)
+                : "a"(7), "c"(0));
+        has[PWB_CLFLUSHOPT] = ebx >> 23 & 1;
+        has[PWB_CLWB] = ebx >> 24 & 1;
+    }
+
+    if (PWB_INSN >= 0 && PWB_INSN <= PWB_NONE && !has[PWB_INSN]) {
+        printinfo(NVWARN, "%s is not supported by this CPU",
+                  pmem_pwb_name(PWB_INSN));
+        PWB_INSN = PWB_AUTO;
+    }
+    if (PWB_INSN < 0 || PWB_INSN > PWB_NONE) {
+        if (PMEM_BACKEND == PMEM_BACKEND_DAX && eadr()) {
+            PWB_INSN = PWB_NONE;
+        } else {
+            for (PWB_INSN = PWB_CLWB; !has[PWB_INSN]; PWB_INSN--)
+                ;
+        }
+    }
+    printinfo(NVINFO, MAG "PWB: %s" RST, pmem_pwb_name(PWB_INSN));
+#endif
+}
+
+//-----------------------------------------------
+// The kernel reads the flush capabilities of the platform in the ACPI NFIT:
+// "cpu_cache" when the caches are flushed to the NVDIMMs on a power failure
+// (eADR), "memory_controller" with ADR only. The log may be on any of the
+// regions: all of them must be eADR, as libpmem2 does.
+//-----------------------------------------------
+int eadr(void) {
+    char path[64], domain[32];
+    int regions = 0;
+    for (int i = 0; i < MAX_NVDIMM_REGIONS; i++) {
+        snprintf(path, sizeof(path),
+                 "/sys/bus/nd/devices/region%d/persistence_domain", i);
+        int fd = musl_open(path, O_RDONLY, 0);
+        if (fd == -1) {
+            continue;  // The numbers may have holes
+        }
+        ssize_t n = musl_read(fd, domain, sizeof(domain) - 1);
+        musl_close(fd);
+        domain[n > 0 ? n : 0] = 0;
+        if (strncmp(domain, "cpu_cache", 9)) {
+            return 0;
+        }
+        regions++;
+    }
+    return regions > 0;
+}
@@ -0,0 +1,16 @@
+#pragma once
+#include <stddef.h>
+#include "nvcache_config.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+const char *pmem_backend_name(int backend);
+char *pmem_default_path(int backend);
+const char *pmem_pwb_name(int pwb);
+void *pmem_map(size_t size, int *fresh);
+
+#ifdef __cplusplus
+}
+#endif
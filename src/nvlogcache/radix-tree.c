@@ -5,8 +5,11 @@
 #include <math.h>
 #include <stdio.h>
 #include <stdatomic.h>
+#include <stdint.h>
+#include <errno.h>
 #include "nvinfo.h"
 #include "nvcache_config.h"
+#include "waitq.h"
 
 
 #define TRACE_ADD 0x1
@@ -25,6 +28,24 @@ static int pool_size  = 0;
 static node nodes_pool;
 static int radix_last_level = 0;
 
+//-----------------------------------------------
+// Concurrency: the inner nodes and the leaves are published with a CAS and
+// never unlinked while the tree lives, so lookups only need acquire loads.
+// The whole tree is released through ebr_retire() (see nvcache_ram.c).
+//
+// A page slot lock is one word: 0 when free, else the owner (pthread_self(),
+// user space addresses fit in 48 bits) in the upper bits and the recursion
+// depth in the lower ones. Waiters park on the waitq of their lock's cache
+// line (see unlock_wq()): an unlock only wakes the waiters of a few slots.
+//-----------------------------------------------
+#define LOCK_DEPTH_BITS 16
+#define LOCK_DEPTH_MASK ((1ULL << LOCK_DEPTH_BITS) - 1)
+#define LOCK_OWNER() ((uint64_t)(uintptr_t)pthread_self() << LOCK_DEPTH_BITS)
+
+#define UNLOCK_WQS 64
+
+static waitq_t unlock_wqs[UNLOCK_WQS];  // All WAITQ_INITIALIZER
+
 
 //-----------------------------------------------
 //              NOT EXPORTED
@@ -43,6 +64,10 @@ static leaf *get_leaf(key k, radix_tree *tree);
 static int free_leaf(leaf *f);
 static void radix_free_node(node *base_node);
 static void clean_radix(node *last_node, key k);
+static leaf *get_or_create_leaf(key k, radix_tree *tree);
+static int slot_trylock(atomic_uint_least64_t *lock);
+static int slot_lock_ready(void *lock);
+static waitq_t *unlock_wq(atomic_uint_least64_t *lock);
 
 
 //-----------------------------------------------
@@ -61,7 +86,8 @@ void radix_init_nodes(int cache_size) {
   printinfo(NVINFO,
 	    GRN "\tCreating radix nodes.\n\tradix_last_level = %d" RST,
 	    radix_last_level);
-  for (int i = 0; i < cache_size; i++) {
+  // Only what the pool keeps, the others are allocated on demand
+  for (int i = 0; i < cache_size && i < RADIX_MAX_POOL_SIZE; i++) {
     add_to_pool(radix_newnode(0, NULL));
   }
 }
@@ -119,11 +145,8 @@ leaf *radix_newleaf(int level, node *parent) {
   for (int i = 0; i < RADIX_MAXCHILDREN; i++) {
     nleaf->pages[i] = NULL;
     nleaf->dirty[i] = 0;
-    // Init recursive lock
-    pthread_mutexattr_t attr;
-    pthread_mutexattr_init(&attr);
-    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
-    pthread_mutex_init(&nleaf->lock[i], &attr);
+    nleaf->writers[i] = 0;
+    nleaf->lock[i] = 0;
   }
   nleaf->level = level;
   nleaf->parent = parent;
@@ -160,7 +183,7 @@ void *radix_find(key k, radix_tree *tree, int *dirty) {
     if (dirty) {
       *dirty = leafnode->dirty[idx];
     }
-    return leafnode->pages[idx];
+    return atomic_load_explicit(&leafnode->pages[idx], memory_order_acquire);
   }
 
   if (dirty) {
@@ -175,14 +198,46 @@ leaf *find_last_node(key k, radix_tree *tree) {
   current_node.subnode = tree->root;
   for (int i = 0; i < radix_last_level; i++) {
     long int value = radix_index(k, i);
-    if (current_node.subnode->children[value].subnode == NULL) {
+    current_node.subnode = atomic_load_explicit(
+        &current_node.subnode->children[value].subnode, memory_order_acquire);
+    if (current_node.subnode == NULL) {
       return NULL;
     }
-    current_node = current_node.subnode->children[value];
   }
   return current_node.leafnode;
 }
 
+//-----------------------------------------------
+// Builds the missing nodes down to the leaf of k (shortened). A node that
+// loses the race was never visible: it is freed right away.
+//-----------------------------------------------
+leaf *get_or_create_leaf(key k, radix_tree *tree) {
+  node *current = tree->root;
+  for (int i = 0; i < radix_last_level; i++) {
+    int value = radix_index(k, i);
+    child *slot = &current->children[value];
+    child next;
+    next.subnode = atomic_load_explicit(&slot->subnode, memory_order_acquire);
+    if (next.subnode == NULL) {
+      child fresh;
+      if (i + 1 == radix_last_level) {
+        fresh.leafnode = radix_newleaf(i + 1, current);
+      } else {
+        fresh.subnode = radix_newnode(i + 1, current);
+      }
+      if (atomic_compare_exchange_strong(&slot->subnode, &next.subnode,
+                                         fresh.subnode)) {
+        next = fresh;
+      } else {
+        // Another thread already added this node : free and continue
+        free(fresh.subnode);
+      }
+    }
+    current = next.subnode;
+  }
+  return (leaf *)current;
+}
+
 //-----------------------------------------------
 int radix_get_dirty_level(key k, radix_tree *tree) {
   k = SHORTEN_KEY(k);
@@ -216,12 +271,7 @@ void radix_decrease_dirty_level(key k, radix_tree *tree) {
 //-----------------------------------------------
 void radix_increase_dirty_level(key k, radix_tree *tree) {
   k = SHORTEN_KEY(k);
-  leaf *l = get_leaf(k, tree);
-  if (l == NULL) {
-    radix_insert(NULL, REAL_KEY(k), tree);
-    l = get_leaf(k, tree);
-    assert(l != NULL);
-  }
+  leaf *l = get_or_create_leaf(k, tree);
 
   int index = radix_index(k, radix_last_level);
   int dirty = l->dirty[index];
@@ -236,35 +286,69 @@ void radix_increase_dirty_level(key k, radix_tree *tree) {
 }
 
 //-----------------------------------------------
-int radix_lock_page(key k, radix_tree *tree) {
-  k = k - k % tree->page_size;
+void radix_add_writers(key k, radix_tree *tree, int n) {
+  k = SHORTEN_KEY(k);
+  leaf *l = get_or_create_leaf(k, tree);
+  atomic_fetch_add(&l->writers[radix_index(k, radix_last_level)], n);
+}
+
+//-----------------------------------------------
+int radix_get_writers(key k, radix_tree *tree) {
   k = SHORTEN_KEY(k);
   leaf *l = get_leaf(k, tree);
   if (l == NULL) {
-    radix_insert(NULL, REAL_KEY(k), tree);
-    l = get_leaf(k, tree);
-    assert(l != NULL);
+    return 0;
   }
+  return atomic_load(&l->writers[radix_index(k, radix_last_level)]);
+}
+
+//-----------------------------------------------
+int slot_trylock(atomic_uint_least64_t *lock) {
+  uint64_t self = LOCK_OWNER();
+  uint_least64_t cur = atomic_load_explicit(lock, memory_order_relaxed);
+  if (cur == 0) {
+    return atomic_compare_exchange_strong_explicit(
+               lock, &cur, self | 1, memory_order_acquire, memory_order_relaxed)
+               ? 0
+               : EBUSY;
+  }
+  if ((cur & ~LOCK_DEPTH_MASK) == self && (cur & LOCK_DEPTH_MASK) < LOCK_DEPTH_MASK) {
+    // Only the owner writes a held lock
+    atomic_store_explicit(lock, cur + 1, memory_order_relaxed);
+    return 0;
+  }
+  return EBUSY;
+}
+
+//-----------------------------------------------
+int slot_lock_ready(void *lock) { return slot_trylock(lock) == 0; }
+
+//-----------------------------------------------
+waitq_t *unlock_wq(atomic_uint_least64_t *lock) {
+  return &unlock_wqs[((uintptr_t)lock >> 6) % UNLOCK_WQS];
+}
+
+//-----------------------------------------------
+int radix_lock_page(key k, radix_tree *tree) {
+  k = k - k % tree->page_size;
+  k = SHORTEN_KEY(k);
+  leaf *l = get_or_create_leaf(k, tree);
 
   int index = radix_index(k, radix_last_level);
-  return pthread_mutex_lock(&l->lock[index]);
+  waitq_wait(unlock_wq(&l->lock[index]), slot_lock_ready, &l->lock[index]);
+  return 0;
 }
 
 //-----------------------------------------------
 int radix_trylock_page(key k, radix_tree *tree) {
   k = k - k % tree->page_size;
   k = SHORTEN_KEY(k);
-  leaf *l = get_leaf(k, tree);
-  if (l == NULL) {
-    radix_insert(NULL, REAL_KEY(k), tree);
-    l = get_leaf(k, tree);
-    assert(l != NULL);
-  }
+  leaf *l = get_or_create_leaf(k, tree);
 
   int index = radix_index(k, radix_last_level);
 
   // Returns 0 on success
-  return pthread_mutex_trylock(&l->lock[index]);
+  return slot_trylock(&l->lock[index]);
 }
 
 //-----------------------------------------------
@@ -275,29 +359,46 @@ int radix_unlock_page(key k, radix_tree *tree) {
   if (l == NULL) return -1;  // Should create the leaf and lock
 
   int index = radix_index(k, radix_last_level);
-  return pthread_mutex_unlock(&l->lock[index]);
+  uint_least64_t cur = atomic_load_explicit(&l->lock[index], memory_order_relaxed);
+  if ((cur & ~LOCK_DEPTH_MASK) != LOCK_OWNER() || cur == 0) {
+    return EPERM;
+  }
+  if ((cur & LOCK_DEPTH_MASK) > 1) {
+    atomic_store_explicit(&l->lock[index], cur - 1, memory_order_relaxed);
+  } else {
+    // seq_cst: a release store may pass the load of the waiters, and a
+    // waiter that registered meanwhile would miss the unlock (see waitq.c)
+    atomic_store_explicit(&l->lock[index], 0, memory_order_seq_cst);
+    waitq_notify(unlock_wq(&l->lock[index]));
+  }
+  return 0;
 }
 
+//-----------------------------------------------
+// Only once nobody can reach the tree anymore (see ebr_retire())
 //-----------------------------------------------
 void radix_free_tree(radix_tree *tree){
   radix_free_node(tree->root);
+  free(tree);
 }
 
 
 //-----------------------------------------------
 void radix_free_node(node *base_node){ // Free subtree of base_node + base_node
   for(int i=0; i<RADIX_MAXCHILDREN; i++){
-    if(base_node->children[i].subnode != NULL || base_node->children[i].leafnode != NULL){
-      if(base_node->level != radix_last_level-1){
-	radix_free_node(base_node->children[i].subnode);
+    child c = base_node->children[i];
+    if(c.subnode != NULL){
+      if(base_node->level + 1 < radix_last_level){
+	radix_free_node(c.subnode);
+      }
+      else {
+	free(c.leafnode);
       }
-      free(&base_node->children[i]);
     }
   }
   free(base_node);
 }
 
-
 //-----------------------------------------------
 int radix_evict(page *p, radix_tree *tree){
   if (p == NULL) {
@@ -305,21 +406,19 @@ int radix_evict(page *p, radix_tree *tree){
   }
   
   off_t k = SHORTEN_KEY(p->offset);
-  leaf *l = p->radix_parent;
-  if (l != NULL) {
-    if (trace(TRACE_DELETE)) {
-      printinfo(NVTRACE, YEL "RADIX : Remove node (key=%ld, fd=%d)" RST,
-		k, p->fd);
-    }
-    l->pages[radix_index(k, radix_last_level)] =
-      NULL;  // Remove pointer to page
-
-
-    return 0;
+  if (trace(TRACE_DELETE)) {
+    printinfo(NVTRACE, YEL "RADIX : Remove node (key=%ld, fd=%d)" RST,
+	      k, p->fd);
   }
-  else {
-    return radix_remove_and_clean(p->offset, tree);
+  // Only if the slot still holds p: the fd may have been reused by
+  // another file since p was cached
+  leaf *l = find_last_node(k, tree);
+  if (l != NULL) {
+    void *expected = p;
+    atomic_compare_exchange_strong(&l->pages[radix_index(k, radix_last_level)],
+                                   &expected, NULL);
   }
+  return 0;
 }
 
 //-----------------------------------------------
@@ -336,8 +435,8 @@ int radix_remove_and_clean(key k, radix_tree *tree) {
       printinfo(NVTRACE, YEL "RADIX : Remove node (key=%ld, tree=%p)" RST,
 		k, tree);
     }
-    l->pages[radix_index(k, radix_last_level)] =
-      NULL;  // Remove pointer to page
+    atomic_store_explicit(&l->pages[radix_index(k, radix_last_level)], NULL,
+                          memory_order_release);  // Remove pointer to page
 
     /*
     // Automatic cleanup : disabled.
@@ -383,36 +482,9 @@ int radix_insert(void *content, key k, radix_tree *tree) {
   }
   k = SHORTEN_KEY(k);
     
-  child current_node;
-  current_node.subnode = tree->root;
-  for (int i = 0; i < radix_last_level; i++) {
-    int value = radix_index(k, i);
-    child expected = current_node.subnode->children[value];
-    if (expected.subnode == NULL && expected.leafnode == NULL) {
-      if (i + 1 == radix_last_level) {
-	child *child_to_add = malloc(sizeof(child));
-	child_to_add->leafnode = radix_newleaf(i + 1, current_node.subnode);
-	if(!atomic_compare_exchange_strong(&current_node.subnode->children[value].leafnode, &expected.leafnode, child_to_add->leafnode)){
-	  // Another thread already added this node : free and continue
-	  free(child_to_add);
-	}
-	      
-	      
-      }
-      else {
-	child *child_to_add = malloc(sizeof(child));
-	child_to_add->subnode = radix_newnode(i + 1, current_node.subnode);
-	if(!atomic_compare_exchange_strong(&current_node.subnode->children[value].subnode, &expected.subnode, child_to_add->subnode)){
-	  // Another thread already added this node : free and continue
-	  free(child_to_add);
-	}
-      }
-	        
-    }
-    current_node = current_node.subnode->children[value];
-  }
-
-  current_node.leafnode->pages[radix_index(k, radix_last_level)] = content;
+  leaf *l = get_or_create_leaf(k, tree);
+  atomic_store_explicit(&l->pages[radix_index(k, radix_last_level)], content,
+                        memory_order_release);
   return 0;
 }
 
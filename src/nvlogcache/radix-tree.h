@@ -17,6 +17,8 @@ int radix_lock_page(key k, radix_tree *tree);
 int radix_trylock_page(key k, radix_tree *tree);
 int radix_unlock_page(key k, radix_tree *tree);
 int radix_get_dirty_level(key k, radix_tree *tree);
+void radix_add_writers(key k, radix_tree *tree, int n);
+int radix_get_writers(key k, radix_tree *tree);
 void *radix_find(key k, radix_tree *tree, int *dirty);
 void radix_free_tree(radix_tree *tree);
   int radix_evict(page *p, radix_tree *tree);
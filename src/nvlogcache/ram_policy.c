@@ -0,0 +1,211 @@
+#include "ram_policy.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "numa.h"
+#include "nvinfo.h"
+
+//-----------------------------------------------
+// The pages of the RAM cache are split in shards, and a page of a file always
+// comes from the shard of its (fd, offset): misses on different pages seldom
+// take the same lock. Each shard runs a CLOCK over its own pages. A hit only
+// sets the reference bit of the page, nothing is moved. To find a victim, the
+// hand of the shard clears the reference bits it meets and skips the busy
+// (locked) pages, it never waits for them. After two turns without a victim,
+// it takes the first page it can lock, hot or referenced, and if it finds
+// none it lets the shard go a moment for their owners to release them.
+//
+// RAM_POLICY_2Q adds the two queues of 2Q as a flag of the page. A page comes
+// in cold and is evicted the first time the hand finds it unreferenced: a
+// large scan only recycles cold pages. A cold page referenced again is
+// promoted hot, and hot pages are only demoted (to cold) while they are more
+// than HOT_RATIO percent of the shard. The shard also remembers the cold
+// pages it evicted (2Q's A1out queue): one of them missing again comes back
+// hot.
+//
+// With RAM_NUMA_SPLIT, the cache is split in one part per NUMA node, each
+// with its own shards, and a miss takes its victim from the part of the node
+// it runs on: the page is then filled and mostly read from local memory.
+//
+// The descriptors are zeroed memory that is never touched at startup: a shard
+// hands out its never used pages first, in order, and only then runs its
+// CLOCK.
+//-----------------------------------------------
+#define HOT_RATIO 75
+#define MIN_SHARD_PAGES 64
+
+typedef struct {
+    pthread_mutex_t lock;
+    page *pages;
+    long nb_pages;
+    long hand;
+    long nb_used;  // Pages handed out at least once
+    long nb_hot, max_hot;
+    uint32_t *ghosts;  // Evicted cold pages, direct-mapped fingerprints
+} __attribute__((aligned(64))) shard_t;
+
+static shard_t *shards;
+static long nb_shards;
+static int nb_parts;
+static long part_shards;  // Shards per part
+
+//-----------------------------------------------
+//             NOT EXPORTED
+//-----------------------------------------------
+static uint64_t page_hash(int fd, off_t offset);
+static uint32_t *ghost_of(shard_t *s, uint64_t h);
+static page *clock_sweep(shard_t *s);
+
+//-----------------------------------------------
+// parts[i] is the first page of part i, parts[nb] the number of pages
+//-----------------------------------------------
+void policy_init(page *pages, const long *parts, int nb) {
+    long smallest = parts[1] - parts[0];
+    for (int i = 1; i < nb; i++) {
+        if (parts[i + 1] - parts[i] < smallest) {
+            smallest = parts[i + 1] - parts[i];
+        }
+    }
+    nb_parts = nb;
+    part_shards = RAM_SHARDS;
+    if (part_shards <= 0) {
+        part_shards = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    part_shards = (part_shards + nb - 1) / nb;
+    if (part_shards > smallest / MIN_SHARD_PAGES) {
+        part_shards = smallest / MIN_SHARD_PAGES;
+    }
+    if (part_shards < 1) {
+        part_shards = 1;
+    }
+    nb_shards = part_shards * nb_parts;
+
+    shards = aligned_alloc(64, nb_shards * sizeof(shard_t));
+    memset(shards, 0, nb_shards * sizeof(shard_t));
+    for (long i = 0; i < nb_shards; i++) {
+        shard_t *s = &shards[i];
+        long part = i / part_shards, j = i % part_shards;
+        long size = parts[part + 1] - parts[part];
+        long first = parts[part] + size * j / part_shards;
+        pthread_mutex_init(&s->lock, NULL);
+        s->pages = pages + first;
+        s->nb_pages = parts[part] + size * (j + 1) / part_shards - first;
+        s->max_hot = s->nb_pages * HOT_RATIO / 100;
+        if (s->max_hot >= s->nb_pages) {
+            s->max_hot = s->nb_pages - 1;
+        }
+        s->ghosts = calloc(s->nb_pages, sizeof(uint32_t));
+    }
+}
+
+//-----------------------------------------------
+uint64_t page_hash(int fd, off_t offset) {
+    uint64_t h = (offset / RAM_PAGE_SIZE) * 0x9E3779B97F4A7C15ULL ^ fd;
+    return h ^ (h >> 29);
+}
+
+//-----------------------------------------------
+// The ghost slot of a page. The low half of its hash is the fingerprint
+// stored there (never 0, 0 is an empty slot).
+//-----------------------------------------------
+uint32_t *ghost_of(shard_t *s, uint64_t h) {
+    return &s->ghosts[(h >> 32) % s->nb_pages];
+}
+
+#define FINGERPRINT(h) ((uint32_t)(h) | 1)
+
+//-----------------------------------------------
+// Returns a locked victim page of the shard of (fd, offset), for this page
+//-----------------------------------------------
+page *policy_evict(int fd, off_t offset) {
+    uint64_t h = page_hash(fd, offset);
+    int part = nb_parts > 1 ? numa_local() % nb_parts : 0;
+    shard_t *s = &shards[part * part_shards + h % part_shards];
+
+    pthread_mutex_lock(&s->lock);
+    page *victim;
+    if (s->nb_used < s->nb_pages) {
+        victim = &s->pages[s->nb_used++];
+        victim->fd = -1;  // Free
+        page_trylock(victim);  // Unknown to the others
+    } else {
+        victim = clock_sweep(s);
+    }
+    if (RAM_POLICY == RAM_POLICY_2Q) {
+        if (victim->fd != -1) {
+            uint64_t old = page_hash(victim->fd, victim->offset);
+            *ghost_of(s, old) = FINGERPRINT(old);
+        }
+        uint32_t *ghost = ghost_of(s, h);
+        if (*ghost == FINGERPRINT(h)) {
+            *ghost = 0;
+            victim->hot = 1;
+            s->nb_hot++;
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    // Plain CLOCK gives a new page a full round, 2Q keeps it cold until
+    // it is referenced again.
+    victim->touched = RAM_POLICY != RAM_POLICY_2Q;
+    return victim;
+}
+
+//-----------------------------------------------
+// Called with the shard locked, the victim is returned locked
+//-----------------------------------------------
+page *clock_sweep(shard_t *s) {
+    for (long steps = 1;; steps++) {
+        page *p = &s->pages[s->hand];
+        if (++s->hand == s->nb_pages) {
+            s->hand = 0;
+        }
+        if (page_trylock(p)) {  // Busy
+            if (steps >= 2 * s->nb_pages) {
+                pthread_mutex_unlock(&s->lock);
+                sched_yield();
+                pthread_mutex_lock(&s->lock);
+                steps = 0;
+            }
+            continue;
+        }
+        if (steps > 2 * s->nb_pages) {
+            // All hot, or referenced again each turn
+            if (p->hot) {
+                p->hot = 0;
+                s->nb_hot--;
+            }
+            return p;
+        }
+        if (p->touched) {
+            p->touched = 0;
+            if (RAM_POLICY == RAM_POLICY_2Q && !p->hot) {
+                p->hot = 1;
+                s->nb_hot++;
+            }
+        } else if (!p->hot) {
+            return p;
+        } else if (s->nb_hot > s->max_hot) {
+            p->hot = 0;
+            s->nb_hot--;
+        }
+        page_unlock(p);
+    }
+}
+
+//-----------------------------------------------
+void policy_print() {
+    long nb_hot = 0;
+    for (long i = 0; i < nb_shards; i++) {
+        nb_hot += shards[i].nb_hot;
+    }
+    printinfo(NVINFO,
+              YEL
+              "\tReplacement : %s, %ld shards (%d parts)\n"
+              "\tHot pages : %ld\n" RST,
+              RAM_POLICY == RAM_POLICY_2Q ? "2Q" : "CLOCK", nb_shards, nb_parts,
+              nb_hot);
+}
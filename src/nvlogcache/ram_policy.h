@@ -0,0 +1,18 @@
+#pragma once
+#include "nvcache_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Replacement policy of the RAM cache, see ram_policy.c
+void policy_init(page *pages, const long *parts, int nb_parts);
+page *policy_evict(int fd, off_t offset);
+void policy_print(void);
+
+// A hit only sets the reference bit of the page
+static inline void policy_touch(page *p) { p->touched = 1; }
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,233 @@
+#define _GNU_SOURCE
+#include "uring.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "nvinfo.h"
+
+//-----------------------------------------------
+// Just enough of io_uring for the write-back of the NVlog: vectored writes
+// and fsyncs, optionally linked. musl 1.1.22 and its headers predate
+// io_uring, the ABI is declared here (see linux/io_uring.h).
+//-----------------------------------------------
+#ifndef SYS_io_uring_setup
+#define SYS_io_uring_setup 425
+#define SYS_io_uring_enter 426
+#endif
+
+#define IORING_OFF_SQ_RING 0ULL
+#define IORING_OFF_CQ_RING 0x8000000ULL
+#define IORING_OFF_SQES 0x10000000ULL
+
+#define IORING_ENTER_GETEVENTS (1U << 0)
+
+#define IORING_OP_WRITEV 2
+#define IORING_OP_FSYNC 3
+
+#define IOSQE_IO_LINK (1U << 2)
+
+struct io_uring_sqe {
+    uint8_t opcode;
+    uint8_t flags;
+    uint16_t ioprio;
+    int32_t fd;
+    uint64_t off;
+    uint64_t addr;
+    uint32_t len;
+    uint32_t op_flags;
+    uint64_t user_data;
+    uint64_t __pad[3];
+};
+
+struct io_uring_cqe {
+    uint64_t user_data;
+    int32_t res;
+    uint32_t flags;
+};
+
+struct io_sqring_offsets {
+    uint32_t head, tail, ring_mask, ring_entries, flags, dropped, array, resv1;
+    uint64_t resv2;
+};
+
+struct io_cqring_offsets {
+    uint32_t head, tail, ring_mask, ring_entries, overflow, cqes, flags, resv1;
+    uint64_t resv2;
+};
+
+struct io_uring_params {
+    uint32_t sq_entries, cq_entries, flags, sq_thread_cpu, sq_thread_idle;
+    uint32_t features, wq_fd, resv[3];
+    struct io_sqring_offsets sq_off;
+    struct io_cqring_offsets cq_off;
+};
+
+// user_data of the fsyncs, the writes carry their size
+#define URING_FSYNC_DATA ((uint64_t)-1)
+
+//-----------------------------------------------
+//             NOT EXPORTED
+//-----------------------------------------------
+static struct io_uring_sqe *uring_get_sqe(uring_t *ring);
+static int uring_enter(uring_t *ring, unsigned to_submit,
+                       unsigned min_complete);
+
+//-----------------------------------------------
+int uring_init(uring_t *ring, unsigned depth) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(ring, 0, sizeof(*ring));
+
+    ring->fd = syscall(SYS_io_uring_setup, depth, &p);
+    if (ring->fd < 0) {
+        return -1;
+    }
+    ring->depth = p.sq_entries;
+
+    // Completions are always reaped before the SQ can be refilled: the CQ
+    // (twice the SQ) never overflows.
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size =
+        p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    char *cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+
+    ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+//-----------------------------------------------
+void uring_exit(uring_t *ring) {
+    uring_submit(ring);
+    uring_reap(ring, ring->inflight);
+    close(ring->fd);
+}
+
+//-----------------------------------------------
+// Number of operations that can be queued without waiting
+//-----------------------------------------------
+unsigned uring_space(uring_t *ring) {
+    return ring->depth - ring->inflight - ring->queued;
+}
+
+//-----------------------------------------------
+// The caller checks uring_space() first
+//-----------------------------------------------
+struct io_uring_sqe *uring_get_sqe(uring_t *ring) {
+    unsigned tail = *ring->sq_tail + ring->queued;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    ++ring->queued;
+    return sqe;
+}
+
+//-----------------------------------------------
+// size is the expected result, link orders the next operation after this one
+//-----------------------------------------------
+void uring_writev(uring_t *ring, int fd, const struct iovec *iov, int iovcnt,
+                  size_t offset, size_t size, int link) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->flags = link ? IOSQE_IO_LINK : 0;
+    sqe->fd = fd;
+    sqe->off = offset;
+    sqe->addr = (uintptr_t)iov;
+    sqe->len = iovcnt;
+    sqe->user_data = size;
+}
+
+//-----------------------------------------------
+void uring_fsync(uring_t *ring, int fd) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->fd = fd;
+    sqe->user_data = URING_FSYNC_DATA;
+}
+
+//-----------------------------------------------
+int uring_enter(uring_t *ring, unsigned to_submit, unsigned min_complete) {
+    int ret;
+    do {
+        ret = syscall(SYS_io_uring_enter, ring->fd, to_submit, min_complete,
+                      min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
+//-----------------------------------------------
+// A link chain must not be split between two submissions
+//-----------------------------------------------
+void uring_submit(uring_t *ring) {
+    if (!ring->queued) {
+        return;
+    }
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + ring->queued,
+                     __ATOMIC_RELEASE);
+    for (unsigned submitted = 0; submitted < ring->queued;) {
+        int ret = uring_enter(ring, ring->queued - submitted, 0);
+        if (ret < 0) {
+            // Already in the ring, they cannot be taken back. The log is
+            // not freed: it will be recovered.
+            printinfo(NVCRIT, "io_uring_enter: %s", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        submitted += ret;
+    }
+    ring->inflight += ring->queued;
+    ring->queued = 0;
+}
+
+//-----------------------------------------------
+// Waits for at least min_complete completions, and reaps all those available
+//-----------------------------------------------
+void uring_reap(uring_t *ring, unsigned min_complete) {
+    min_complete = min_complete < ring->inflight ? min_complete : ring->inflight;
+    while (ring->inflight) {
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            if (!min_complete) {
+                return;
+            }
+            uring_enter(ring, 0, min_complete);
+            continue;
+        }
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            uint64_t expected =
+                cqe->user_data == URING_FSYNC_DATA ? 0 : cqe->user_data;
+            if (cqe->res < 0 || (uint64_t)cqe->res != expected) {
+                printinfo(NVCRIT, "Run to the hills size=%lu written=%d (%s)",
+                          expected, cqe->res,
+                          cqe->res < 0 ? strerror(-cqe->res) : "short");
+                ++ring->errors;
+            }
+            --ring->inflight;
+            if (min_complete) {
+                --min_complete;
+            }
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+}
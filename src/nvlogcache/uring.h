@@ -0,0 +1,35 @@
+#pragma once
+#include <stddef.h>
+#include <sys/uio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Minimal io_uring, see uring.c
+typedef struct {
+    int fd;
+    unsigned depth;     // SQ entries
+    unsigned inflight;  // Submitted, not reaped yet
+    unsigned queued;    // Prepared, not submitted yet
+    unsigned errors;    // Failed completions since uring_init()
+    // SQ ring
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+    // CQ ring
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+} uring_t;
+
+int uring_init(uring_t *ring, unsigned depth);
+void uring_exit(uring_t *ring);
+unsigned uring_space(uring_t *ring);
+void uring_writev(uring_t *ring, int fd, const struct iovec *iov, int iovcnt,
+                  size_t offset, size_t size, int link);
+void uring_fsync(uring_t *ring, int fd);
+void uring_submit(uring_t *ring);
+void uring_reap(uring_t *ring, unsigned min_complete);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,63 @@
+#define _GNU_SOURCE
+#include "waitq.h"
+#include <limits.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define FUTEX_WAIT 0
+#define FUTEX_WAKE 1
+#define FUTEX_PRIVATE 128
+
+// Bounds of the spin budget (iterations of ready())
+#define WAITQ_MIN_SPINS 16
+#define WAITQ_MAX_SPINS 4096
+
+//-----------------------------------------------
+// Spins on ready() first, then parks on the futex until a notification finds
+// ready() true. The spin budget grows when spinning was enough and shrinks
+// when the thread had to park, so that short waits stay cheap and long ones
+// do not burn a core.
+//
+// The notifier must make ready() true before calling waitq_notify(): a waiter
+// registers itself before its last check of ready(), and the notifier checks
+// the waiters after its update, so one of them sees the other.
+//-----------------------------------------------
+void waitq_wait(waitq_t *q, int (*ready)(void *), void *arg) {
+    int spins = atomic_load_explicit(&q->spins, memory_order_relaxed);
+    if (spins < WAITQ_MIN_SPINS) {
+        spins = WAITQ_MIN_SPINS;
+    }
+    for (int i = 0; i < spins; i++) {
+        if (ready(arg)) {
+            if (spins < WAITQ_MAX_SPINS) {
+                atomic_store_explicit(&q->spins, spins * 2,
+                                      memory_order_relaxed);
+            }
+            return;
+        }
+        __asm__ volatile("pause" ::: "memory");
+    }
+    atomic_store_explicit(&q->spins, spins / 2, memory_order_relaxed);
+
+    atomic_fetch_add(&q->waiters, 1);
+    while (1) {
+        int seq = atomic_load(&q->seq);
+        if (ready(arg)) {
+            break;
+        }
+        syscall(SYS_futex, &q->seq, FUTEX_WAIT | FUTEX_PRIVATE, seq, NULL);
+    }
+    atomic_fetch_sub(&q->waiters, 1);
+}
+
+//-----------------------------------------------
+// Wakes every parked thread, they check their condition again. Almost free
+// when nobody waits.
+//-----------------------------------------------
+void waitq_notify(waitq_t *q) {
+    if (atomic_load(&q->waiters) == 0) {
+        return;
+    }
+    atomic_fetch_add(&q->seq, 1);
+    syscall(SYS_futex, &q->seq, FUTEX_WAKE | FUTEX_PRIVATE, INT_MAX);
+}
@@ -0,0 +1,24 @@
+#pragma once
+#include <stdatomic.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Adaptive wait/notify on a condition, see waitq.c
+typedef struct {
+    atomic_int seq;      // Futex word, bumped by each notification
+    atomic_int waiters;  // Parked threads
+    atomic_int spins;    // Spin budget before parking, adapted
+} waitq_t;
+
+#define WAITQ_INITIALIZER {0, 0, 0}
+
+void waitq_wait(waitq_t *q, int (*ready)(void *), void *arg);
+void waitq_notify(waitq_t *q);
+
+static inline int waitq_waiters(waitq_t *q) { return atomic_load(&q->waiters); }
+
+#ifdef __cplusplus
+}
+#endif